@@ -0,0 +1,168 @@
+#include "camera.h"
+#include "pathtrace.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "scheduler.h"
+#include "settings.h"
+#include "utils.h"
+#include "vector_type.h"
+#include "wavefront.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Renders the brain without a window for every volume storage and reports the frame times of trace for every render
+// type and of the wavefront stages, then compares the octree with the macrocell grid on Manix when it is available.
+// Usage: benchmark [resolution] [frames]
+
+struct Storage
+{
+    VolumeLayout layout;
+    VoxelFormat format;
+    float sparseThreshold;
+    std::string name;
+    int brickCacheSize = 0; // Mapped from the cache when set
+};
+
+float renderFrames(scg::Scene const& scene, scg::Settings const& settings, int resolution, int frames)
+{
+    scg::Camera camera{
+        scg::Vec3f(0, 0, -240),
+        scg::Vec3f(0, 0, 0),
+        resolution,
+        resolution,
+        true, // Jitter
+        0.2f, // Aperture
+        3.0f}; // Focal length
+
+    scg::TileScheduler scheduler(resolution, resolution);
+
+    scg::Wavefront wavefront;
+    std::vector<scg::Vec3f> image((size_t)resolution * resolution);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        if (settings.useWavefront)
+        {
+            wavefront.render(scene, camera, scg::Vec3f(0, 0, 0), settings, scheduler.samplers.data(), image.data());
+            scene.volume->trimCache();
+            continue;
+        }
+
+        scheduler.run([&](scg::Tile const& tile, scg::Vec3f *colours, scg::Sampler &sampler)
+        {
+            for (int y = 0; y < tile.height; ++y)
+            {
+                for (int x = 0; x < tile.width; x += PACKET_SIZE)
+                {
+                    int count = std::min(PACKET_SIZE, tile.width - x);
+                    scg::Ray rays[PACKET_SIZE];
+
+                    for (int i = 0; i < count; ++i)
+                    {
+                        rays[i] = camera.getRay(tile.x + x + i, tile.y + y, sampler);
+                        rays[i].minT = scg::RAY_EPS;
+                    }
+
+                    scg::tracePacket(scene, rays, colours + y * tile.width + x, count, settings, sampler);
+                }
+            }
+        }, image.data());
+
+        scene.volume->trimCache();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<float, std::milli>(end - start).count() / frames;
+}
+
+int main(int argc, char *argv[])
+{
+    int resolution = argc > 1 ? std::stoi(argv[1]) : 256;
+    int frames = argc > 2 ? std::stoi(argv[2]) : 4;
+
+    std::vector<Storage> storages{
+        {VolumeLayout::Linear, VoxelFormat::Float32, 0, "Linear Float32"},
+        {VolumeLayout::Bricked, VoxelFormat::Float32, 0, "Bricked Float32"},
+        {VolumeLayout::Linear, VoxelFormat::UInt16, 0, "Linear UInt16"},
+        {VolumeLayout::Linear, VoxelFormat::UInt8, 0, "Linear UInt8"},
+        {VolumeLayout::Linear, VoxelFormat::Float16, 0, "Linear Float16"},
+        {VolumeLayout::Bricked, VoxelFormat::UInt16, 0, "Bricked UInt16"},
+        // The background of the brain scan stays below 1250
+        {VolumeLayout::Sparse, VoxelFormat::Float32, 1250, "Sparse Float32"},
+        {VolumeLayout::Sparse, VoxelFormat::UInt16, 1250, "Sparse UInt16"},
+        // Streamed from disk with a cache smaller than the volume
+        {VolumeLayout::Bricked, VoxelFormat::UInt16, 0, "Mapped Bricked UInt16", 4}
+    };
+
+    for (auto const& storage : storages)
+    {
+        scg::Settings settings = scg::loadSettings();
+        scg::loadSettingsFile(settings);
+        settings.volumeLayout = storage.layout;
+        settings.voxelFormat = storage.format;
+        settings.sparseThreshold = storage.sparseThreshold;
+        settings.useCache = storage.brickCacheSize > 0;
+        settings.brickCacheSize = storage.brickCacheSize;
+
+        scg::Scene scene;
+        scg::loadBrain(scene, settings);
+
+        if (!scene.volume)
+        {
+            return 1;
+        }
+
+        std::cout << storage.name << ": " << scene.volume->getMemoryUsage() / (1024 * 1024) << " MB" << std::endl;
+
+        settings.useWavefront = false;
+        for (int renderType = 0; renderType < 5; ++renderType)
+        {
+            settings.renderType = renderType;
+
+            float time = renderFrames(scene, settings, resolution, frames);
+
+            std::cout << "  renderType " << renderType << ": " << time << " ms/frame" << std::endl;
+        }
+
+        // The wavefront tracks the volume through the macrocell grid whatever the renderType
+        settings.useWavefront = true;
+        float wavefrontTime = renderFrames(scene, settings, resolution, frames);
+
+        std::cout << "  wavefront: " << wavefrontTime << " ms/frame" << std::endl;
+    }
+
+    // The Manix loader does not fail on a missing file, check it first
+    if (!std::ifstream("../data/Manix/manix.raw"))
+    {
+        std::cout << "Manix: skipped, ../data/Manix/manix.raw not found" << std::endl;
+        return 0;
+    }
+
+    scg::Settings settings = scg::loadSettings();
+    scg::loadSettingsFile(settings);
+
+    scg::Scene scene;
+    scg::loadManix(scene, settings);
+
+    std::cout << "Manix: " << scene.volume->getMemoryUsage() / (1024 * 1024) << " MB" << std::endl;
+
+    // Octree against macrocell grid, both delta tracking
+    for (int renderType : {1, 3})
+    {
+        settings.renderType = renderType;
+
+        float time = renderFrames(scene, settings, resolution, frames);
+
+        std::cout << "  renderType " << renderType << ": " << time << " ms/frame" << std::endl;
+    }
+
+    return 0;
+}
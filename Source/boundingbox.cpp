@@ -50,4 +50,9 @@ void BoundingBox::getIntersection(Ray const& ray, BBIntersection &intersection)
     intersection.valid	= true;
 }
 
+BoundingBox intersect(BoundingBox const& a, BoundingBox const& b)
+{
+    return BoundingBox(maxV(a.min, b.min), minV(a.max, b.max));
+}
+
 }
\ No newline at end of file
@@ -61,6 +61,9 @@ public:
     void getIntersection(Ray const& ray, BBIntersection &) const;
 };
 
+// Box covered by both arguments
+BoundingBox intersect(BoundingBox const&, BoundingBox const&);
+
 }
 
 #endif //RAYTRACER_BOUNDINGBOX_H
@@ -0,0 +1,122 @@
+#include "brickcache.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace scg
+{
+
+BrickCache::BrickCache(MappedFile const& file, uint8_t const* voxels, size_t brickSize, size_t brickCount,
+                       size_t capacity, std::vector<bool> shared):
+    file(file), voxels(voxels), brickSize(brickSize), capacity(capacity), pageSize(MappedFile::getPageSize()),
+    shared(std::move(shared)), lastUse(brickCount)
+{
+    this->shared.resize(brickCount, false);
+}
+
+void BrickCache::trim()
+{
+    size_t count = resident.load(std::memory_order_relaxed);
+
+    if (count > capacity)
+    {
+        std::vector<std::pair<uint32_t, size_t>> used;
+        used.reserve(count);
+
+        for (size_t brick = 0; brick < lastUse.size(); ++brick)
+        {
+            uint32_t last = lastUse[brick].load(std::memory_order_relaxed);
+            if (last != 0 && !shared[brick])
+            {
+                used.emplace_back(last, brick);
+            }
+        }
+
+        // Oldest first, resident shared bricks count against the capacity
+        size_t evicted = std::min(count - capacity, used.size());
+        std::nth_element(used.begin(), used.begin() + evicted, used.end());
+
+        for (size_t i = 0; i < evicted; ++i)
+        {
+            lastUse[used[i].second].store(0, std::memory_order_relaxed);
+        }
+
+        // Pages are released once every brick on them is evicted
+        for (size_t i = 0; i < evicted; ++i)
+        {
+            release(used[i].second);
+        }
+
+        resident.fetch_sub(evicted, std::memory_order_relaxed);
+    }
+
+    // 0 marks bricks that are not resident
+    uint32_t next = clock.load(std::memory_order_relaxed) + 1;
+    clock.store(next != 0 ? next : 1, std::memory_order_relaxed);
+}
+
+void BrickCache::clear()
+{
+    // Only whole pages of bricks, neighbouring data may be in use
+    uintptr_t begin = ((uintptr_t)voxels + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t end = ((uintptr_t)voxels + brickSize * lastUse.size()) & ~(pageSize - 1);
+
+    if (begin < end)
+    {
+        file.evict(reinterpret_cast<void const*>(begin), end - begin);
+    }
+
+    for (auto& last : lastUse)
+    {
+        last.store(0, std::memory_order_relaxed);
+    }
+
+    resident.store(0, std::memory_order_relaxed);
+}
+
+bool BrickCache::isPageUsed(uintptr_t page) const
+{
+    uintptr_t begin = (uintptr_t)voxels;
+    uintptr_t end = begin + brickSize * lastUse.size();
+
+    if (page < begin || page + pageSize > end)
+    {
+        return true;
+    }
+
+    for (size_t brick = (page - begin) / brickSize; brick <= (page + pageSize - 1 - begin) / brickSize; ++brick)
+    {
+        if (lastUse[brick].load(std::memory_order_relaxed) != 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void BrickCache::release(size_t brick) const
+{
+    uintptr_t begin = (uintptr_t)voxels + brick * brickSize;
+
+    // Bricks are not page aligned, the first and last pages may hold resident neighbours
+    uintptr_t first = begin & ~(pageSize - 1);
+    uintptr_t last = (begin + brickSize - 1) & ~(pageSize - 1);
+
+    if (isPageUsed(first))
+    {
+        first += pageSize;
+    }
+
+    if (first <= last && isPageUsed(last))
+    {
+        last -= pageSize;
+    }
+
+    if (first <= last)
+    {
+        file.evict(reinterpret_cast<void const*>(first), last + pageSize - first);
+    }
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef RAYTRACER_BRICKCACHE_H
+#define RAYTRACER_BRICKCACHE_H
+
+#include "mappedfile.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace scg
+{
+
+// Keeps the most recently used bricks of a mapped volume resident, evicting the least recently used ones
+// Rays touch bricks concurrently, trim() must be called between frames by a single thread
+class BrickCache
+{
+public:
+    // The bricks are stored one after another from voxels, brickSize bytes each
+    // Shared bricks are stored once for several bricks of the volume, they are never evicted
+    BrickCache(MappedFile const& file, uint8_t const* voxels, size_t brickSize, size_t brickCount, size_t capacity,
+               std::vector<bool> shared = {});
+
+    BrickCache(BrickCache const&) = delete;
+    BrickCache& operator =(BrickCache const&) = delete;
+
+    // Marks a stored brick as used this frame, requesting it from the file the first time
+    inline void touch(size_t brick)
+    {
+        uint32_t now = clock.load(std::memory_order_relaxed);
+
+        if (lastUse[brick].load(std::memory_order_relaxed) == now)
+        {
+            return;
+        }
+
+        if (lastUse[brick].exchange(now, std::memory_order_relaxed) == 0)
+        {
+            resident.fetch_add(1, std::memory_order_relaxed);
+            file.prefetch(voxels + brick * brickSize, brickSize);
+        }
+    }
+
+    // Evicts the least recently used bricks above the capacity and starts a new frame
+    void trim();
+
+    // Evicts every brick
+    void clear();
+
+    inline size_t getResidentBricks() const
+    {
+        return resident.load(std::memory_order_relaxed);
+    }
+
+    inline size_t getCapacity() const
+    {
+        return capacity;
+    }
+
+private:
+    MappedFile const& file;
+    uint8_t const* voxels;
+    size_t brickSize;
+    size_t capacity;
+    size_t pageSize;
+    std::vector<bool> shared;
+
+    // Frame of the last use of every brick, 0 when not resident
+    std::vector<std::atomic<uint32_t>> lastUse;
+    std::atomic<uint32_t> clock{1};
+    std::atomic<size_t> resident{0};
+
+    // Whether a resident brick, or data outside the bricks, lies on the page starting at page
+    bool isPageUsed(uintptr_t page) const;
+
+    // Releases the pages of an evicted brick that no resident brick lies on
+    void release(size_t brick) const;
+};
+
+}
+
+#endif //RAYTRACER_BRICKCACHE_H
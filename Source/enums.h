@@ -16,4 +16,19 @@ enum BSDFLobe
     Specular = SpecularReflection | SpecularTransmission
 };
 
+enum VolumeLayout
+{
+    Linear = 0,
+    Bricked = 1,
+    Sparse = 2
+};
+
+enum VoxelFormat
+{
+    Float32 = 0,
+    UInt16 = 1,
+    UInt8 = 2,
+    Float16 = 3
+};
+
 #endif //RAYTRACER_ENUMS_H
@@ -0,0 +1,99 @@
+#ifndef RAYTRACER_HALF_H
+#define RAYTRACER_HALF_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+namespace scg
+{
+
+// IEEE 754 binary16, only used for storage
+class Half
+{
+public:
+    uint16_t bits;
+
+    Half() = default;
+
+    explicit Half(float value)
+    {
+#ifdef __F16C__
+        bits = (uint16_t)_cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+#else
+        uint32_t f;
+        std::memcpy(&f, &value, sizeof(f));
+
+        uint32_t sign = (f >> 16) & 0x8000;
+        int32_t exponent = (int32_t)((f >> 23) & 0xff) - 127 + 15;
+        uint32_t mantissa = f & 0x7fffff;
+
+        if (exponent >= 31)
+        {
+            // Overflow to infinity, keep NaN
+            bits = (uint16_t)(sign | 0x7c00 | (((f & 0x7fffffff) > 0x7f800000) ? 0x200 : 0));
+        }
+        else if (exponent <= 0)
+        {
+            // Subnormal or zero
+            if (exponent < -10)
+            {
+                bits = (uint16_t)sign;
+            }
+            else
+            {
+                mantissa |= 0x800000;
+                uint32_t shift = (uint32_t)(14 - exponent);
+                uint32_t rounded = (mantissa + (1u << (shift - 1))) >> shift;
+                bits = (uint16_t)(sign | rounded);
+            }
+        }
+        else
+        {
+            // Round to nearest, a carry into the exponent is still correct
+            uint32_t rounded = (((uint32_t)exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+            bits = (uint16_t)(sign | std::min<uint32_t>(rounded, 0x7c00));
+        }
+#endif
+    }
+
+    inline operator float() const
+    {
+#ifdef __F16C__
+        return _cvtsh_ss(bits);
+#else
+        uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+        uint32_t exponent = (bits >> 10) & 0x1f;
+        uint32_t mantissa = bits & 0x3ff;
+        uint32_t f;
+
+        if (exponent == 0x1f)
+        {
+            f = sign | 0x7f800000 | (mantissa << 13);
+        }
+        else if (exponent != 0)
+        {
+            f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+        else
+        {
+            // Subnormal: the value is mantissa * 2^-24, exact in float
+            float value = (float)mantissa * (1.0f / 16777216.0f);
+            std::memcpy(&f, &value, sizeof(f));
+            f |= sign;
+        }
+
+        float value;
+        std::memcpy(&value, &f, sizeof(value));
+        return value;
+#endif
+    }
+};
+
+}
+
+#endif //RAYTRACER_HALF_H
@@ -0,0 +1,121 @@
+#include "macrocellgrid.h"
+
+#include "math_utils.h"
+#include "transferfunction.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace scg
+{
+
+void MacrocellGrid::updateMajorants(TransferFunction const& transferFunction)
+{
+    majorants.resize(cells.size());
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < (int)cells.size(); ++i)
+    {
+        majorants[i] = transferFunction.getMaxOpacity(cells[i].min, cells[i].max);
+    }
+
+    updateDistances();
+}
+
+void MacrocellGrid::updateDistances()
+{
+    distances.resize(cells.size());
+
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        distances[i] = majorants[i] > 0.0f ? 0 : 255;
+    }
+
+    // Two raster scans, each over the neighbours already visited, give the exact Chebyshev distance
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        int sign = pass == 0 ? -1 : 1;
+
+        for (int i = 0; i < width; ++i)
+        {
+            for (int j = 0; j < height; ++j)
+            {
+                for (int k = 0; k < depth; ++k)
+                {
+                    int x = pass == 0 ? i : width - 1 - i;
+                    int y = pass == 0 ? j : height - 1 - j;
+                    int z = pass == 0 ? k : depth - 1 - k;
+
+                    uint8_t &distance = distances[getIndex(x, y, z)];
+                    if (distance == 0)
+                    {
+                        continue;
+                    }
+
+                    for (int dx = -1; dx <= 1; ++dx)
+                    {
+                        for (int dy = -1; dy <= 1; ++dy)
+                        {
+                            for (int dz = -1; dz <= 1; ++dz)
+                            {
+                                // Only the neighbours this scan already visited
+                                int first = dx != 0 ? dx : dy != 0 ? dy : dz;
+                                if (first != sign ||
+                                    x + dx < 0 || x + dx >= width || y + dy < 0 || y + dy >= height || z + dz < 0 || z + dz >= depth)
+                                {
+                                    continue;
+                                }
+
+                                distance = (uint8_t)std::min<int>(distance, distances[getIndex(x + dx, y + dy, z + dz)] + 1);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+float MacrocellGrid::getLeapT(Ray const& ray, float t) const
+{
+    Vec3f position = ray(t);
+    int cell[3] = {(int)std::floor(position.x / MACROCELL_SIZE), (int)std::floor(position.y / MACROCELL_SIZE),
+                   (int)std::floor(position.z / MACROCELL_SIZE)};
+    int size[3] = {width, height, depth};
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (cell[axis] < 0 || cell[axis] >= size[axis])
+        {
+            return t;
+        }
+    }
+
+    int distance = distances[getIndex(cell[0], cell[1], cell[2])];
+    if (distance == 0)
+    {
+        return t;
+    }
+
+    // Cells closer than the distance are empty, the leap stops at the border of the grid
+    float leapT = INF;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float direction = ray.direction.data[axis];
+        if (direction > 0)
+        {
+            int end = std::min(cell[axis] + distance, size[axis]);
+            leapT = std::min(leapT, t + (end * MACROCELL_SIZE - position.data[axis]) / direction);
+        }
+        else if (direction < 0)
+        {
+            int end = std::max(cell[axis] - distance + 1, 0);
+            leapT = std::min(leapT, t + (end * MACROCELL_SIZE - position.data[axis]) / direction);
+        }
+    }
+
+    return leapT;
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef RAYTRACER_MACROCELLGRID_H
+#define RAYTRACER_MACROCELLGRID_H
+
+#include "boundingbox.h"
+#include "ray.h"
+#include "transferfunction.h"
+#include "vector_type.h"
+
+#include <cstdint>
+#include <vector>
+
+// Macrocells are cubes of MACROCELL_SIZE voxels
+#define MACROCELL_BITS 3
+#define MACROCELL_SIZE (1 << MACROCELL_BITS)
+
+namespace scg
+{
+
+// Range of the values that can be sampled inside a macrocell, independent of the transfer function
+struct Macrocell
+{
+    float min = 0.0f;
+    float max = 0.0f;
+};
+
+// Uniform grid of macrocells covering the volume, traversed with a 3D-DDA
+class MacrocellGrid
+{
+public:
+    int width = 0;  // Cells along x
+    int height = 0; // Cells along y
+    int depth = 0;  // Cells along z
+
+    std::vector<Macrocell> cells; // Indexed with z varying fastest
+
+    // Largest opacity of every cell under the current transfer function
+    std::vector<float> majorants;
+
+    // Chebyshev distance in cells to the nearest cell with a non-zero majorant, at most 255
+    std::vector<uint8_t> distances;
+
+    inline size_t getIndex(int x, int y, int z) const
+    {
+        return ((size_t)x * height + y) * depth + z;
+    }
+
+    // Bounds of a cell, in voxel coordinates
+    inline BoundingBox getBounds(int x, int y, int z) const
+    {
+        Vec3f min = Vec3f(x, y, z) * (float)MACROCELL_SIZE;
+
+        return BoundingBox(min, min + Vec3f((float)MACROCELL_SIZE));
+    }
+
+    // Distance at which the ray leaves the empty cells around the point at distance t, t when there are none
+    float getLeapT(Ray const& ray, float t) const;
+
+    // Recomputes the majorants and the distances, called whenever the transfer function changes
+    void updateMajorants(TransferFunction const& transferFunction);
+
+    void updateDistances();
+};
+
+}
+
+#endif //RAYTRACER_MACROCELLGRID_H
@@ -3,10 +3,12 @@
 #include "ray.h"
 #include "sampler.h"
 #include "scene.h"
+#include "scheduler.h"
 #include "settings.h"
 #include "SDLauxiliary.h"
 #include "utils.h"
 #include "vector_type.h"
+#include "wavefront.h"
 
 #include <SDL.h>
 
@@ -31,8 +33,6 @@ void Draw(screen *screen);
 void InitialiseBuffer();
 void saveScreenshot(screen *screen);
 
-scg::Sampler sampler[20]; // TODO: !!! find a better solution
-
 scg::Camera camera{
     scg::Vec3f(0, 0, -240),
     scg::Vec3f(0, 0, 0),
@@ -46,9 +46,8 @@ scg::Vec3f rotation{0, 0, 0};
 
 scg::Settings settings;
 scg::Scene scene;
-
-scg::Volume volume(VOLUME_SIZE, VOLUME_SIZE, VOLUME_SIZE);
-scg::Volume temp(VOLUME_SIZE, VOLUME_SIZE, VOLUME_SIZE);
+scg::Wavefront wavefront;
+scg::TileScheduler scheduler(SCREEN_WIDTH, SCREEN_HEIGHT);
 
 int samples;
 scg::Vec3f buffer[SCREEN_HEIGHT][SCREEN_WIDTH];
@@ -63,9 +62,9 @@ int main(int argc, char *argv[])
     settings = scg::loadSettings();
     scg::loadSettingsFile(settings);
     //scene = scg::loadTestModel(150.0f);
-    scg::loadBrain(volume, temp, scene, settings);
-    //scg::loadManix(volume, temp, scene, settings);
-    //scg::loadBunny(volume, temp, scene, settings);
+    scg::loadBrain(scene, settings);
+    //scg::loadManix(scene, settings);
+    //scg::loadBunny(scene, settings);
 
     // Start main loop
     while (Update(screen))
@@ -85,24 +84,76 @@ void Draw(screen *screen)
 {
     ++samples;
 
-    // TODO: reseed generator
-    #pragma omp parallel for schedule(dynamic) shared(camera, scene, settings, screen)
-    for (int y = 0; y < SCREEN_HEIGHT; ++y)
+    if (settings.useWavefront)
     {
-        for (int x = 0; x < SCREEN_WIDTH; ++x)
+        static scg::Vec3f frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+        memset(frame, 0, sizeof(frame));
+
+        wavefront.render(scene, camera, rotation, settings, scheduler.samplers.data(), &frame[0][0]);
+
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < SCREEN_HEIGHT; ++y)
         {
-            scg::Ray ray = camera.getRay(x, y, sampler[omp_get_thread_num()]);
-            ray.minT = scg::RAY_EPS;
-            
-            ray.origin = scg::rotate(ray.origin, rotation);
-            ray.direction = scg::rotate(ray.direction, rotation);
+            for (int x = 0; x < SCREEN_WIDTH; ++x)
+            {
+                buffer[y][x] += frame[y][x] * settings.gamma; // TODO: clamp value
+
+                PutPixelSDL(screen, x, y, buffer[y][x] / samples);
+            }
+        }
+
+        if (scene.volume)
+        {
+            scene.volume->trimCache();
+        }
+
+        return;
+    }
+
+    scheduler.run([](scg::Tile const& tile, scg::Vec3f *colours, scg::Sampler &sampler)
+    {
+        for (int y = 0; y < tile.height; ++y)
+        {
+            // Neighbouring pixels are traced together
+            for (int x = 0; x < tile.width; x += PACKET_SIZE)
+            {
+                int count = std::min(PACKET_SIZE, tile.width - x);
+                scg::Ray rays[PACKET_SIZE];
 
-            scg::Vec3f colour = scg::trace(scene, ray, settings, sampler[omp_get_thread_num()]);
-            buffer[y][x] += colour * settings.gamma; // TODO: clamp value
+                for (int i = 0; i < count; ++i)
+                {
+                    rays[i] = camera.getRay(tile.x + x + i, tile.y + y, sampler);
+                    rays[i].minT = scg::RAY_EPS;
 
+                    rays[i].origin = scg::rotate(rays[i].origin, rotation);
+                    rays[i].direction = scg::rotate(rays[i].direction, rotation);
+                }
+
+                scg::Vec3f *row = colours + y * tile.width + x;
+                scg::tracePacket(scene, rays, row, count, settings, sampler);
+
+                for (int i = 0; i < count; ++i)
+                {
+                    row[i] = row[i] * settings.gamma; // TODO: clamp value
+                }
+            }
+        }
+    }, &buffer[0][0]);
+
+    // The screen is written once the whole frame is traced
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < SCREEN_HEIGHT; ++y)
+    {
+        for (int x = 0; x < SCREEN_WIDTH; ++x)
+        {
             PutPixelSDL(screen, x, y, buffer[y][x] / samples);
         }
     }
+
+    if (scene.volume)
+    {
+        scene.volume->trimCache();
+    }
 }
 
 bool Update(screen *screen)
@@ -138,6 +189,19 @@ bool Update(screen *screen)
                     settings.renderType = 2;
                     InitialiseBuffer();
                     break;
+                case SDLK_3:
+                    settings.renderType = 3;
+                    InitialiseBuffer();
+                    break;
+                case SDLK_4:
+                    settings.renderType = 4;
+                    InitialiseBuffer();
+                    break;
+                case SDLK_f:
+                    /* Switch between trace and the wavefront stages */
+                    settings.useWavefront = !settings.useWavefront;
+                    InitialiseBuffer();
+                    break;
                 case SDLK_ESCAPE:
                     /* Move camera quit */
                     return false;
@@ -164,6 +228,10 @@ bool Update(screen *screen)
                 case SDLK_r:
                     InitialiseBuffer();
                     scg::loadSettingsFile(settings);
+                    if (scene.volume)
+                    {
+                        scg::updateMajorants(*scene.volume, settings.transferFunction);
+                    }
                     break;
                 case SDLK_p:
                     saveScreenshot(screen);
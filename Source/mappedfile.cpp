@@ -0,0 +1,138 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace scg
+{
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(std::string const& path)
+{
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        file = nullptr;
+        return;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        return;
+    }
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+    {
+        return;
+    }
+
+    data = static_cast<uint8_t const*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    size = data != nullptr ? (size_t)fileSize.QuadPart : 0;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mapping != nullptr)
+        CloseHandle(mapping);
+    if (file != nullptr)
+        CloseHandle(file);
+}
+
+void MappedFile::prefetch(void const* address, size_t length) const
+{
+#if _WIN32_WINNT >= 0x0602
+    WIN32_MEMORY_RANGE_ENTRY range{const_cast<void*>(address), length};
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    (void)address;
+    (void)length;
+#endif
+}
+
+void MappedFile::evict(void const* address, size_t length) const
+{
+    // Unlocking pages that are not locked removes them from the working set
+    VirtualUnlock(const_cast<void*>(address), length);
+}
+
+size_t MappedFile::getPageSize()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+#else
+
+MappedFile::MappedFile(std::string const& path)
+{
+    file = open(path.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+        return;
+    }
+
+    struct stat status;
+    if (fstat(file, &status) != 0 || status.st_size == 0)
+    {
+        return;
+    }
+
+    void* address = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0);
+    if (address == MAP_FAILED)
+    {
+        return;
+    }
+
+    data = static_cast<uint8_t const*>(address);
+    size = (size_t)status.st_size;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr)
+        munmap(const_cast<uint8_t*>(data), size);
+    if (file >= 0)
+        close(file);
+}
+
+// madvise works on whole pages, round the range outwards
+inline void advise(void const* address, size_t length, int advice)
+{
+    static uintptr_t const pageSize = MappedFile::getPageSize();
+
+    uintptr_t begin = (uintptr_t)address & ~(pageSize - 1);
+    uintptr_t end = ((uintptr_t)address + length + pageSize - 1) & ~(pageSize - 1);
+
+    madvise(reinterpret_cast<void*>(begin), end - begin, advice);
+}
+
+void MappedFile::prefetch(void const* address, size_t length) const
+{
+    advise(address, length, MADV_WILLNEED);
+}
+
+void MappedFile::evict(void const* address, size_t length) const
+{
+    advise(address, length, MADV_DONTNEED);
+}
+
+size_t MappedFile::getPageSize()
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+#endif
+
+}
@@ -0,0 +1,50 @@
+#ifndef RAYTRACER_MAPPEDFILE_H
+#define RAYTRACER_MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace scg
+{
+
+// Read only view of a whole file, paged in on demand by the operating system
+class MappedFile
+{
+public:
+    uint8_t const* data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(std::string const& path);
+    ~MappedFile();
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator =(MappedFile const&) = delete;
+
+    inline bool isOpen() const
+    {
+        return data != nullptr;
+    }
+
+    // Hints that the range will be read soon, the pages are read in the background
+    void prefetch(void const* address, size_t length) const;
+
+    // Releases the pages of the range, they are read again from the file when touched
+    // The range is rounded outwards to whole pages, anything else on them is released too
+    void evict(void const* address, size_t length) const;
+
+    // Granularity of prefetch and evict, in bytes
+    static size_t getPageSize();
+
+private:
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#else
+    int file = -1;
+#endif
+};
+
+}
+
+#endif //RAYTRACER_MAPPEDFILE_H
@@ -21,7 +21,9 @@ public:
     virtual float pdf(ScatterEvent const& interaction) const = 0;
 
     virtual BSDFLobe getSupportedLobes(Vec2f const&) const = 0;
-    virtual std::shared_ptr<Light> getLight(Vec2f const&) const
+
+    // Not owning, the material keeps its light alive
+    virtual Light const* getLight(Vec2f const&) const
     {
         return nullptr;
     }
@@ -63,9 +65,9 @@ public:
         return BSDFLobe::Diffuse;
     }
 
-    std::shared_ptr<Light> getLight(Vec2f const&) const override
+    Light const* getLight(Vec2f const&) const override
     {
-        return light;
+        return light.get();
     }
 };
 
@@ -2,6 +2,7 @@
 #define RAYTRACER_MATH_UTILS_H
 
 #include <cmath>
+#include <cstdint>
 
 namespace scg
 {
@@ -23,6 +24,23 @@ inline T clamp(T const& value, T const& low, T const& high)
     return value < low ? low : value > high ? high : value;
 }
 
+// Interleaves the lower 21 bits of each coordinate (Z-order curve)
+inline uint64_t mortonEncode(uint32_t x, uint32_t y, uint32_t z)
+{
+    auto spread = [](uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffff;
+        v = (v | v << 16) & 0x1f0000ff0000ff;
+        v = (v | v << 8) & 0x100f00f00f00f00f;
+        v = (v | v << 4) & 0x10c30c30c30c30c3;
+        v = (v | v << 2) & 0x1249249249249249;
+        return v;
+    };
+
+    return (spread(x) << 2) | (spread(y) << 1) | spread(z);
+}
+
 inline float toRadians(float degree)
 {
     return degree * (float)M_PI / 180.0f;
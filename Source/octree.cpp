@@ -10,4 +10,15 @@ Octree::Octree(BoundingBox const& bb)
     this->bb = bb;
 }
 
+void Octree::updateMajorants(TransferFunction const& transferFunction)
+{
+    majorants.resize(nodes.size());
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < (int)nodes.size(); ++i)
+    {
+        majorants[i] = transferFunction.getMaxOpacity(nodes[i].min, nodes[i].max);
+    }
+}
+
 }
\ No newline at end of file
@@ -2,22 +2,222 @@
 #define RAYTRACER_OCTREE_H
 
 #include "boundingbox.h"
+#include "ray.h"
+#include "transferfunction.h"
+#include "vector_type.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Deepest octree that can be built and traversed
+#define OCTREE_MAX_LEVELS 16
 
 namespace scg
 {
 
+// Node of a linear octree, 12 bytes
+// Child i covers the upper half along x if (i & 4), along y if (i & 2) and along z if (i & 1)
+struct OctreeNode
+{
+    uint32_t children = 0; // Index of the first of the 8 consecutive children, 0 for leaves
+    float min = 0.0f;      // Range of the values that can be sampled inside, independent of the transfer function
+    float max = 0.0f;
+};
+
+// Nodes stored breadth first, root first, bounds derived from the level and position of a node
 class Octree
 {
 public:
-    BoundingBox bb;
-    Octree* nodes[8];
-    bool isLeaf;
+    BoundingBox bb; // Bounds of the root
+    std::vector<OctreeNode> nodes;
 
-    int mask; // Mask for buckets inside
+    // Largest opacity inside every node under the current transfer function, indexed as the nodes
+    std::vector<float> majorants;
 
     Octree() = default;
 
     Octree(BoundingBox const&);
+
+    inline bool isLeaf(uint32_t node) const
+    {
+        return nodes[node].children == 0;
+    }
+
+    // Recomputes the majorants, called whenever the transfer function changes
+    void updateMajorants(TransferFunction const& transferFunction);
+
+    // Bounds of the node at cell (x, y, z) of the 2^level cells along each axis
+    inline BoundingBox getBounds(int level, int x, int y, int z) const
+    {
+        Vec3f size = (bb.max - bb.min) / (float)(1 << level);
+        Vec3f min = bb.min + Vec3f(x, y, z) * size;
+
+        return BoundingBox(min, min + size);
+    }
+};
+
+// Parametric traversal (Revelles et al.), visits the nodes pierced by a ray front to back without allocating
+// Directions are mirrored to be positive, child i of the mirrored octree is child i ^ mirror of the octree
+class OctreeTraversal
+{
+public:
+    struct Frame
+    {
+        uint32_t node;
+        int x, y, z; // Cell of the node on its level
+        Vec3f t0;    // Distances at which the ray enters the slabs of the node
+        Vec3f t1;    // And leaves them
+        Vec3f tm;    // And crosses their middle
+        int child;   // Child being visited, mirrored
+    };
+
+    Octree const& octree;
+    int mirror = 0;
+    int depth = -1; // Level of the current node, -1 once the traversal is over
+    Frame frames[OCTREE_MAX_LEVELS + 1];
+
+    OctreeTraversal(Octree const& octree, Ray const& ray):
+        octree(octree)
+    {
+        Frame &root = frames[0];
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // Parallel rays get a tiny slope instead of infinite distances
+            float direction = ray.direction.data[axis];
+            if (std::fabs(direction) < 1e-7f)
+            {
+                direction = 1e-7f;
+            }
+
+            float t0 = (octree.bb.min.data[axis] - ray.origin.data[axis]) / direction;
+            float t1 = (octree.bb.max.data[axis] - ray.origin.data[axis]) / direction;
+
+            if (direction < 0)
+            {
+                std::swap(t0, t1);
+                mirror |= 4 >> axis;
+            }
+
+            root.t0.data[axis] = t0;
+            root.t1.data[axis] = t1;
+        }
+
+        root.node = 0;
+        root.x = root.y = root.z = 0;
+
+        if (getMinT(root) < getMaxT(root))
+        {
+            depth = 0;
+        }
+    }
+
+    inline bool isValid() const
+    {
+        return depth >= 0;
+    }
+
+    inline Frame const& current() const
+    {
+        return frames[depth];
+    }
+
+    // Distances at which the ray enters and leaves the current node
+    inline float getMinT(Frame const& frame) const
+    {
+        return std::max(std::max(frame.t0.x, frame.t0.y), frame.t0.z);
+    }
+
+    inline float getMaxT(Frame const& frame) const
+    {
+        return std::min(std::min(frame.t1.x, frame.t1.y), frame.t1.z);
+    }
+
+    // Continues with the first child of the current node, which must not be a leaf
+    inline void descend()
+    {
+        Frame &frame = frames[depth];
+        frame.tm = (frame.t0 + frame.t1) * 0.5f;
+
+        // The plane through which the ray enters the node decides the first child
+        float minT = getMinT(frame);
+        int child = 0;
+
+        if (frame.t0.x >= frame.t0.y && frame.t0.x >= frame.t0.z)
+        {
+            child |= (frame.tm.y < minT ? 2 : 0) | (frame.tm.z < minT ? 1 : 0);
+        }
+        else if (frame.t0.y >= frame.t0.z)
+        {
+            child |= (frame.tm.x < minT ? 4 : 0) | (frame.tm.z < minT ? 1 : 0);
+        }
+        else
+        {
+            child |= (frame.tm.x < minT ? 4 : 0) | (frame.tm.y < minT ? 2 : 0);
+        }
+
+        enter(child);
+    }
+
+    // Returns to the deepest node still holding distance t, its children behind t are then skipped front to back
+    inline void leap(float t)
+    {
+        while (depth >= 0 && getMaxT(frames[depth]) <= t)
+        {
+            --depth;
+        }
+    }
+
+    // Continues with the node following the current one and its children
+    inline void skip()
+    {
+        while (--depth >= 0)
+        {
+            Frame const& frame = frames[depth];
+            int child = frame.child;
+
+            // The child is left through the closest of its exit planes, the parent too if that plane is its own
+            float exitX = (child & 4) ? frame.t1.x : frame.tm.x;
+            float exitY = (child & 2) ? frame.t1.y : frame.tm.y;
+            float exitZ = (child & 1) ? frame.t1.z : frame.tm.z;
+
+            int axis = exitX < exitY ? (exitX < exitZ ? 4 : 1) : (exitY < exitZ ? 2 : 1);
+
+            if (!(child & axis))
+            {
+                enter(child | axis);
+                return;
+            }
+        }
+    }
+
+private:
+    inline void enter(int child)
+    {
+        Frame &parent = frames[depth];
+        Frame &frame = frames[depth + 1];
+        int id = child ^ mirror;
+
+        parent.child = child;
+
+        frame.node = octree.nodes[parent.node].children + id;
+        frame.x = 2 * parent.x + ((id >> 2) & 1);
+        frame.y = 2 * parent.y + ((id >> 1) & 1);
+        frame.z = 2 * parent.z + (id & 1);
+
+        frame.t0 = Vec3f(
+            (child & 4) ? parent.tm.x : parent.t0.x,
+            (child & 2) ? parent.tm.y : parent.t0.y,
+            (child & 1) ? parent.tm.z : parent.t0.z);
+        frame.t1 = Vec3f(
+            (child & 4) ? parent.t1.x : parent.tm.x,
+            (child & 2) ? parent.t1.y : parent.tm.y,
+            (child & 1) ? parent.t1.z : parent.tm.z);
+
+        ++depth;
+    }
 };
 
 }
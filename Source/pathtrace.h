@@ -20,32 +20,42 @@ inline float powerHeuristic(int nf, float fPdf, int ng, float gPdf)
     return (f * f) / (f * f + g * g);
 }
 
-Vec3f SampleOneLight(ScatterEvent& interaction, Scene const& scene, std::shared_ptr<Material> const& material,
-                     std::shared_ptr<Light> const& hitLight, Settings const& settings, Sampler& sampler)
+// Light picked for next event estimation, its contribution only counts when nothing blocks the shadow ray
+struct LightSample
 {
+    Vec3f contribution;
+    Ray shadowRay;
+    float distance = 0.0f; // Distance to the light along the shadow ray
+    bool needsShadowRay = false;
+};
+
+// Materials and lights are not owned here, the scene and the transfer function keep them alive
+inline LightSample SampleLight(ScatterEvent& interaction, Scene const& scene, Material const* material,
+                               Light const* hitLight, Sampler& sampler)
+{
+    LightSample sample;
+
     // Cannot light mirror
     if ((material->getSupportedLobes(interaction.uv) & BSDFLobe::Specular) != 0)
     {
-        return Vec3f(0, 0, 0);
+        return sample;
     }
 
     // Cannot sample another light
     if (scene.lights.size() == 0 || (scene.lights.size() <= 1 && hitLight != nullptr))
     {
-        return Vec3f(0, 0, 0);
+        return sample;
     }
 
     // Find another light
-    std::shared_ptr<Light> light;
+    Light const* light;
     do
     {
         size_t index = (size_t)sampler.nextDiscrete(scene.lights.size());
-        light = scene.lights[index];
+        light = scene.lights[index].get();
     } while (light == hitLight);
 
     // Calculate light
-    Vec3f directLight;
-
     LightType lightType = light->getType();
     LightHit lightHit = light->illuminate(interaction, sampler);
 
@@ -59,7 +69,7 @@ Vec3f SampleOneLight(ScatterEvent& interaction, Scene const& scene, std::shared_
                 float pdf = material->pdf(interaction);
                 if (pdf != 0)
                 {
-                    directLight += material->evaluate(interaction) * lightHit.colour / lightHit.pdf; // TODO: fix formula
+                    sample.contribution = material->evaluate(interaction) * lightHit.colour / lightHit.pdf; // TODO: fix formula
                 }
             }
 
@@ -69,23 +79,19 @@ Vec3f SampleOneLight(ScatterEvent& interaction, Scene const& scene, std::shared_
         case LightType_Directional:
         case LightType_Object:
         {
-            Ray lightRay{interaction.position, lightHit.direction, RAY_EPS};
-            Intersection lightIntersection{};
-
             if (std::isnormal(lightHit.pdf)) // Real number, not 0
             {
-                // Check for objects blocking the path
-                if (!getClosestIntersection(scene, lightRay, lightIntersection, settings, sampler) ||
-                    lightIntersection.distance + EPS >= lightHit.distance)
+                interaction.inputDir = lightHit.direction;
+                float pdf = material->pdf(interaction);
+                if (pdf != 0)
                 {
-                    getClosestIntersection(scene, lightRay, lightIntersection, settings, sampler);
-                    interaction.inputDir = lightHit.direction;
-                    float pdf = material->pdf(interaction);
-                    if (pdf != 0)
-                    {
-                        float weight = powerHeuristic(1, lightHit.pdf, 1, pdf);
-                        directLight += material->evaluate(interaction) * lightHit.colour * weight / lightHit.pdf;
-                    }
+                    float weight = powerHeuristic(1, lightHit.pdf, 1, pdf);
+                    sample.contribution = material->evaluate(interaction) * lightHit.colour * weight / lightHit.pdf;
+
+                    // Check for objects blocking the path
+                    sample.shadowRay = Ray{interaction.position, lightHit.direction, RAY_EPS};
+                    sample.distance = lightHit.distance;
+                    sample.needsShadowRay = true;
                 }
             }
 
@@ -93,14 +99,121 @@ Vec3f SampleOneLight(ScatterEvent& interaction, Scene const& scene, std::shared_
         }
     }
 
-    return directLight * scene.lights.size();
+    sample.contribution *= (float)scene.lights.size();
+
+    return sample;
+}
+
+inline bool isOccluded(LightSample const& sample, Scene const& scene, Settings const& settings, Sampler& sampler)
+{
+    Intersection lightIntersection{};
+
+    return getClosestIntersection(scene, sample.shadowRay, lightIntersection, settings, sampler, settings.shadowMipLevel) &&
+           lightIntersection.distance + EPS < sample.distance;
+}
+
+inline Vec3f SampleOneLight(ScatterEvent& interaction, Scene const& scene, Material const* material,
+                            Light const* hitLight, Settings const& settings, Sampler& sampler)
+{
+    LightSample sample = SampleLight(interaction, scene, material, hitLight, sampler);
+
+    if (sample.needsShadowRay && isOccluded(sample, scene, settings, sampler))
+    {
+        return Vec3f(0, 0, 0);
+    }
+
+    return sample.contribution;
 }
 
-Vec3f trace(
+// Fills the interaction at a hit and picks its material, the colour of volume samples goes into the throughput
+inline Material const* getInteraction(Scene const& scene, Ray const& ray, Intersection const& intersection, ScatterEvent &interaction,
+                                      Vec3f &throughput, Settings const& settings, Sampler &sampler)
+{
+    interaction.position = intersection.position;
+    interaction.normal = intersection.normal;
+    interaction.uv = interaction.uv;
+    interaction.outputDir = -ray.direction;
+    interaction.iorO = 0.0f;
+
+    if (intersection.surfaceType != SurfaceType::Volume)
+    {
+        return scene.materials[intersection.materialID].get();
+    }
+
+    Vec3f localPos = scene.volume->toVoxel(intersection.position - scene.volumePos);
+    Vec3f normal;
+    float intensity = scene.volume->sampleVolumeGradient(localPos, 0.5f, normal); // TODO: Maybe use TransferFunction
+    normal /= scene.volume->spacing; // Per scene unit
+    float magnitude = normal.length();
+    Vec4f out = settings.transferFunction.evaluate(intensity);
+
+    interaction.normal = normal / magnitude;
+
+    // T. Kroes
+    //float probBRDF = (1.0f - std::exp(-settings.gradientFactor * (magnitude * scene.invMaxGradient)));
+    float probBRDF = (1.0f - std::exp(-settings.gradientFactor * (magnitude / intensity)));
+
+    // Surface
+    if (sampler.nextFloat() < probBRDF)
+    {
+        interaction.position += interaction.normal * settings.stepSize;
+
+        throughput *= Vec3f{out.r, out.g, out.b};
+        return settings.transferFunction.getMaterial(intensity, sampler);
+    }
+
+    // Isotropic
+    throughput *= 2.0f; // TODO: probably wrong, but looks better
+    throughput *= Vec3f{out.r, out.g, out.b};
+    return settings.transferFunction.getPhase();
+}
+
+// Samples the direction of the next bounce and updates the throughput, false when Russian roulette ends the path
+inline bool scatter(Material const* material, ScatterEvent &interaction, Ray &ray, Vec3f &throughput, int bounces,
+                    Settings const& settings, Sampler &sampler)
+{
+    // Sample next direction
+    float pdf;
+    do
+    {
+        material->sample(interaction, sampler);
+        pdf = material->pdf(interaction);
+    } while(!std::isnormal(pdf)); // Sampler may return an impossible(parallel) direction
+
+    // Accumulate
+    throughput *= material->evaluate(interaction) / pdf;
+
+    if (interaction.sampledLobe == BSDFLobe::SpecularTransmission)
+    {
+        interaction.iorI = interaction.iorO;
+    }
+
+    // Create new ray
+    ray.origin = interaction.position;
+    ray.direction = interaction.inputDir;
+    ray.minT = RAY_EPS;
+
+    // Russian Roulette
+    if (bounces >= settings.minDepth - 1)
+    {
+        float p = std::max(throughput.x, std::max(throughput.y, throughput.z));
+        if (sampler.nextFloat() > p) {
+            return false;
+        }
+
+        throughput /= p;
+    }
+
+    return true;
+}
+
+// The first intersection can be given, a negative objectID then marks a miss
+inline Vec3f trace(
     Scene const& scene,
     Ray ray,
     Settings const& settings,
-    Sampler &sampler)
+    Sampler &sampler,
+    Intersection const* primary = nullptr)
 {
     Vec3f colour;
     Vec3f throughput(1.0f, 1.0f, 1.0f);
@@ -109,7 +222,6 @@ Vec3f trace(
     interaction.iorI = 1.0f; // Air
 
     int bounces = 0;
-    int minBounces = settings.minDepth;
     int maxBounces = settings.maxDepth;
 
     for (bounces = 0; bounces < maxBounces; ++bounces)
@@ -117,57 +229,30 @@ Vec3f trace(
         // Intersect the scene
         Intersection intersection;
 
-        if (!getClosestIntersection(scene, ray, intersection, settings, sampler))
-        {
-            colour += throughput * settings.backgroundLight;
-            break;
-        }
+        // Detail is lost deeper into the path, sample a coarser level
+        int level = bounces >= settings.bounceMipDepth ? settings.bounceMipLevel : 0;
 
-        // Initialise interaction
-        interaction.position = intersection.position;
-        interaction.normal = intersection.normal;
-        interaction.uv = interaction.uv;
-        interaction.outputDir = -ray.direction;
-        interaction.iorO = 0.0f;
-
-        std::shared_ptr<Material> material;
-
-        if (intersection.surfaceType == SurfaceType::Volume)
+        bool hit;
+        if (bounces == 0 && primary != nullptr)
         {
-            Vec3f localPos = intersection.position - scene.volumePos;
-            Vec3f normal = scene.volume->getGradient(localPos, 0.5f); // TODO: Maybe use TransferFunction
-            float magnitude = normal.length();
-            float intensity = scene.volume->sampleVolume(localPos);
-            Vec4f out = settings.transferFunction.evaluate(intensity);
-
-            interaction.normal = normal / magnitude;
-
-            // T. Kroes
-            //float probBRDF = (1.0f - std::exp(-settings.gradientFactor * (magnitude * scene.invMaxGradient)));
-            float probBRDF = (1.0f - std::exp(-settings.gradientFactor * (magnitude / intensity)));
-
-            // Surface
-            if (sampler.nextFloat() < probBRDF)
-            {
-                interaction.position += interaction.normal * settings.stepSize;
-
-                throughput *= Vec3f{out.r, out.g, out.b};
-                material = settings.transferFunction.getMaterial(intensity, sampler);
-            }
-            // Isotropic
-            else
-            {
-                throughput *= 2.0f; // TODO: probably wrong, but looks better
-                material = std::make_shared<Isotropic>(Isotropic{std::make_shared<ColourTexture>(ColourTexture{{out.x, out.y,  out.z}})});
-            }
+            intersection = *primary;
+            hit = primary->objectID >= 0;
         }
         else
         {
-            material = scene.materials[intersection.materialID];
+            hit = getClosestIntersection(scene, ray, intersection, settings, sampler, level);
         }
 
+        if (!hit)
+        {
+            colour += throughput * settings.backgroundLight;
+            break;
+        }
+
+        Material const* material = getInteraction(scene, ray, intersection, interaction, throughput, settings, sampler);
+
         // Add light
-        auto const& hitLight = material->getLight(interaction.uv);
+        Light const* hitLight = material->getLight(interaction.uv);
         if (hitLight != nullptr && (bounces == 0 || interaction.sampledLobe & BSDFLobe::Specular))
         {
             colour += throughput * hitLight->getEmittance(interaction);
@@ -179,41 +264,36 @@ Vec3f trace(
         if (bounces == maxBounces - 1)
             break;
 
-        // Sample next direction
-        float pdf;
-        do
-        {
-            material->sample(interaction, sampler);
-            pdf = material->pdf(interaction);
-        } while(!std::isnormal(pdf)); // Sampler may return an impossible(parallel) direction
+        if (!scatter(material, interaction, ray, throughput, bounces, settings, sampler))
+            break;
+    }
 
-        // Accumulate
-        if (!std::isnormal(pdf)) std::cout << "WTF";
-        throughput *= material->evaluate(interaction) / pdf;
+    return colour / (1 + bounces);
+}
 
-        if (interaction.sampledLobe == BSDFLobe::SpecularTransmission)
-        {
-            interaction.iorI = interaction.iorO;
-        }
+// Traces up to PACKET_SIZE camera rays, their first intersections are found together
+inline void tracePacket(
+    Scene const& scene,
+    Ray const* rays,
+    Vec3f *colours,
+    int count,
+    Settings const& settings,
+    Sampler &sampler)
+{
+    Intersection intersections[PACKET_SIZE];
+    bool hits[PACKET_SIZE];
 
-        // Create new ray
-        ray.origin = interaction.position;
-        ray.direction = interaction.inputDir;
-        ray.minT = RAY_EPS;
+    getClosestIntersectionPacket(scene, rays, intersections, hits, count, settings, sampler);
 
-        // Russian Roulette
-        if (bounces >= minBounces - 1)
+    for (int lane = 0; lane < count; ++lane)
+    {
+        if (!hits[lane])
         {
-            float p = std::max(throughput.x, std::max(throughput.y, throughput.z));
-            if (sampler.nextFloat() > p) {
-                break;
-            }
-
-            throughput /= p;
+            intersections[lane].objectID = -1;
         }
-    }
 
-    return colour / (1 + bounces);
+        colours[lane] = trace(scene, rays[lane], settings, sampler, &intersections[lane]);
+    }
 }
 
 }
@@ -10,28 +10,127 @@
 
 #include <algorithm>
 #include <iostream>
-#include <stack>
 
 namespace scg
 {
 
-float dT = 0.0001;
+// Extinction bounding a region of the given opacity for delta tracking
+// Capped at the density past which castRayWoodcock accepts every free-flight step, so all estimate the same image
+inline float getMajorant(Settings const& settings, float maxOpacity)
+{
+    return std::min(settings.densityScale * maxOpacity, 1.0f / settings.stepSize);
+}
+
+// Delta tracking from minT to maxT under a constant majorant, true at the first real collision
+inline bool trackSegment(Volume const& volume, Ray const& ray, float minT, float maxT, float majorant,
+                         Intersection &intersection, Settings const& settings, Sampler &sampler)
+{
+    Vec3f positions[SIMD_WIDTH];
+    float distances[SIMD_WIDTH];
+    float coefs[SIMD_WIDTH];
+    float opacities[SIMD_WIDTH];
+
+    float invMajorant = 1.0f / majorant;
+
+    // Free flights restart at every segment, distances are memoryless
+    float t = minT + (-std::log(sampler.nextFloat())) * invMajorant;
+
+    while (t <= maxT)
+    {
+        // Take the next free-flight steps ahead and sample them together
+        int count = 0;
+        while (count < SIMD_WIDTH && t <= maxT)
+        {
+            positions[count] = ray(t);
+            distances[count] = t;
+            ++count;
+
+            t += (-std::log(sampler.nextFloat())) * invMajorant;
+        }
+
+        volume.sampleVolumeN(positions, coefs, count);
+        settings.transferFunction.evaluateOpacityN(coefs, opacities, count);
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (sampler.nextFloat() < opacities[i] * settings.densityScale * invMajorant)
+            {
+                intersection.position   = positions[i];
+                intersection.distance   = distances[i];
+                intersection.surfaceType = SurfaceType::Volume;
+
+                return true;
+            }
+        }
+    }
 
-struct State
+    return false;
+}
+
+// Amanatides-Woo traversal of a uniform grid of cells of cellSize voxels, the first one starting at offset
+struct GridDDA
 {
-    Octree const* node;
-    float minT;
-    float maxT;
-    int nodesMask; // Intersection with child nodes
+    int cell[3];
+    int step[3];
+    int end[3];      // First cell past the grid along each axis, in the direction of the ray
+    float nextT[3];  // Distance at which the ray leaves the cell along each axis
+    float deltaT[3]; // Distance between two cell boundaries along each axis
+    float minT;      // Distance at which the ray enters the cell
 
-    State() = default;
+    GridDDA() = default;
 
-    State(Octree const* node, float minT, float maxT)
+    // Starts from the cell holding the point at minT, the grid spans cells min to max (inclusive) along each axis
+    GridDDA(Ray const& ray, float minT, float offset, float cellSize, int const min[3], int const max[3])
     {
-        this->node = node;
+        Vec3f entry = ray(minT);
         this->minT = minT;
-        this->maxT = maxT;
-        this->nodesMask = 0;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float position = entry.data[axis] - offset;
+            cell[axis] = clamp((int)std::floor(position / cellSize), min[axis], max[axis]);
+
+            float direction = ray.direction.data[axis];
+            if (direction > 0)
+            {
+                step[axis] = 1;
+                end[axis] = max[axis] + 1;
+                nextT[axis] = minT + ((cell[axis] + 1) * cellSize - position) / direction;
+                deltaT[axis] = cellSize / direction;
+            }
+            else if (direction < 0)
+            {
+                step[axis] = -1;
+                end[axis] = min[axis] - 1;
+                nextT[axis] = minT + (cell[axis] * cellSize - position) / direction;
+                deltaT[axis] = -cellSize / direction;
+            }
+            else
+            {
+                step[axis] = 0;
+                end[axis] = min[axis] - 1;
+                nextT[axis] = INF;
+                deltaT[axis] = INF;
+            }
+        }
+    }
+
+    // Distance at which the ray leaves the current cell
+    inline float getMaxT() const
+    {
+        return std::min(std::min(nextT[0], nextT[1]), nextT[2]);
+    }
+
+    // Moves to the next cell, false once the ray left the grid
+    inline bool next()
+    {
+        int axis = nextT[0] < nextT[1] ? (nextT[0] < nextT[2] ? 0 : 2) : (nextT[1] < nextT[2] ? 1 : 2);
+
+        minT = nextT[axis];
+        cell[axis] += step[axis];
+        nextT[axis] += deltaT[axis];
+
+        return cell[axis] != end[axis];
     }
 };
 
@@ -54,24 +153,38 @@ bool castRayWoodcock(Volume const& volume, Ray const& ray, Intersection &interse
 
     float invMaxDensity = 1.0f;
 
+    Vec3f positions[SIMD_WIDTH];
+    float distances[SIMD_WIDTH];
+    float coefs[SIMD_WIDTH];
+    float opacities[SIMD_WIDTH];
+
     while (minT <= maxT)
     {
-        Vec3f pos = ray.origin + ray.direction * minT;
+        // Take the next free-flight steps ahead and sample them together
+        int count = 0;
+        while (count < SIMD_WIDTH && minT <= maxT)
+        {
+            positions[count] = ray.origin + ray.direction * minT;
+            distances[count] = minT;
+            ++count;
 
-        float coef = volume.sampleVolume(pos);
+            minT += (-std::log(sampler.nextFloat())) * invMaxDensity * settings.stepSize;
+        }
 
-        Vec4f out = settings.transferFunction.evaluate(coef);
+        volume.sampleVolumeN(positions, coefs, count);
+        settings.transferFunction.evaluateOpacityN(coefs, opacities, count);
 
-        if (sampler.nextFloat() < out.w * invMaxDensity * settings.densityScale * settings.stepSize)
+        for (int i = 0; i < count; ++i)
         {
-            intersection.position   = pos;
-            intersection.distance   = minT;
-            intersection.surfaceType = SurfaceType::Volume;
+            if (sampler.nextFloat() < opacities[i] * invMaxDensity * settings.densityScale * settings.stepSize)
+            {
+                intersection.position   = positions[i];
+                intersection.distance   = distances[i];
+                intersection.surfaceType = SurfaceType::Volume;
 
-            return true;
+                return true;
+            }
         }
-
-        minT += (-std::log(sampler.nextFloat())) * invMaxDensity * settings.stepSize;
     }
 
     return false;
@@ -79,259 +192,673 @@ bool castRayWoodcock(Volume const& volume, Ray const& ray, Intersection &interse
 
 bool castRayWoodcockFast(Volume const& volume, Ray ray, Intersection &intersection, Settings const& settings, Sampler &sampler)
 {
-    Vec3f color(0, 0, 0);
-
-    std::stack<State> st;
+    OctreeTraversal traversal(volume.octree, ray);
 
-    BBIntersection bbIntersection;
-    volume.octree.bb.getIntersection(ray, bbIntersection);
-    if (bbIntersection.valid)
-    {
-        st.push(State(&volume.octree, bbIntersection.nearT, bbIntersection.farT));
-    }
-
-    ray.minT +=  (-std::log(sampler.nextFloat())) * settings.stepSize;
-
-    while (!st.empty() && ray.minT <= ray.maxT)
+    while (traversal.isValid() && ray.minT <= ray.maxT)
     {
-        State &state = st.top();
-        Octree const* node = state.node;
-
-        float minT = std::max(ray.minT, state.minT);
-        float maxT = std::min(ray.maxT, state.maxT);
+        OctreeTraversal::Frame const& frame = traversal.current();
+        float minT = std::max(ray.minT, traversal.getMinT(frame));
+        float maxT = std::min(ray.maxT, traversal.getMaxT(frame));
 
-        // Ray was moved by a previous node
+        // Behind the ray or past its end
         if (minT > maxT)
         {
-            st.pop();
+            traversal.skip();
             continue;
         }
 
+        float maxOpacity = volume.octree.majorants[frame.node];
+
         // Skip
-        if (!(node->mask & settings.mask))
+        if (maxOpacity <= 0.0f)
         {
             // Jump into next node
-            ray.minT = maxT + dT;
-            st.pop();
+            ray.minT = maxT;
+            traversal.skip();
             continue;
         }
 
-        // Continue 'recursively'
-        if (!node->isLeaf)
+        // Continue with the children, front to back
+        if (!volume.octree.isLeaf(frame.node))
         {
-            // Find first child
-            while(minT <= maxT)
-            {
-                Vec3f mid = node->bb.mid;
-                Vec3f entry = ray(minT);
-                Vec3f dist = entry - mid;
+            traversal.descend();
+            continue;
+        }
 
-                bool sideX = dist.x >= 0;
-                bool sideY = dist.y >= 0;
-                bool sideZ = dist.z >= 0;
+        // Cast ray inside node, with free flights sized by the majorant of the leaf
+        volume.prefetch(volume.octree.getBounds(traversal.depth, frame.x, frame.y, frame.z));
 
-                int id = (sideX << 2) | (sideY << 1) | (sideZ);
+        if (trackSegment(volume, ray, minT, maxT, getMajorant(settings, maxOpacity), intersection, settings, sampler))
+        {
+            return true;
+        }
 
-                // We need to jump over
-                if (state.nodesMask & (1 << id))
-                {
-                    minT += dT;
-                    ray.minT = minT + dT;
-                    continue;
-                }
+        // Jump into next node
+        ray.minT = maxT;
+        traversal.skip();
+    }
 
-                node->nodes[id]->bb.getIntersection(ray, bbIntersection);
-                state.nodesMask &= (1 << id);
+    return false;
+}
 
-                // We need to jump over
-                if (!bbIntersection.valid)
-                {
-                    minT += dT;
-                    ray.minT = minT + dT;
-                    continue;
-                }
+// Ray marching state of castRayWoodcockFast2, carried from leaf to leaf
+struct MarchState
+{
+    float S = 0.0f; // Accumulated density at which the ray scatters
+    float sum = 0.0f;
 
-                st.push(State(node->nodes[id], bbIntersection.nearT, bbIntersection.farT));
-                break;
-            }
+    bool needsJitter = true;
 
-            continue;
+    // With pre-integration samples are joined by segments, a jump starts a new chain at the entry point
+    bool needsEntry = false;
+    float lastT = 0.0f;
+    float lastCoef = 0.0f;
+};
+
+// Marches through a leaf from minT to maxT, minT is left at the next step
+inline bool marchLeaf(Volume const& volume, Ray const& ray, float &minT, float maxT, float maxOpacity, MarchState &state,
+                      Intersection &intersection, Settings const& settings, Sampler &sampler)
+{
+    Vec3f positions[SIMD_WIDTH];
+    float distances[SIMD_WIDTH];
+    float coefs[SIMD_WIDTH];
+
+    float stepSize = lerp(1.0f, settings.stepSize, clamp(0.0f, 1.0f, settings.densityScale * maxOpacity));
+
+    if (state.needsJitter)
+    {
+        state.lastT = minT;
+        state.needsEntry = settings.preIntegrate;
+
+        minT += sampler.nextFloat() * stepSize;
+        state.needsJitter = false;
+    }
+
+    while (minT <= maxT)
+    {
+        // Sample the next steps together, after the entry point of a new chain
+        int count = 0;
+        if (state.needsEntry)
+        {
+            positions[count] = ray(state.lastT);
+            distances[count] = state.lastT;
+            ++count;
         }
 
-        // Cast ray inside node
-/*
-        float maxOpacity = 0.0f;
-        for (int i = 0; i < (int)settings.maxOpacity.size(); ++i)
+        int first = count;
+        while (count < SIMD_WIDTH && minT <= maxT)
         {
-            if (node->mask & (1 << i) && settings.maxOpacity[i] > maxOpacity)
-            {
-                maxOpacity = settings.maxOpacity[i];
-            }
+            positions[count] = ray(minT);
+            distances[count] = minT;
+            ++count;
+
+            minT += stepSize;
         }
-//*/
-        float invMaxOpacity = 1.0f;// / maxOpacity;
-        //float invMaxOpacityDensity = invMaxOpacity / settings.densityScale;
 
-        while (minT <= maxT)
+        volume.sampleVolumeN(positions, coefs, count);
+
+        if (state.needsEntry)
         {
-            Vec3f pos = ray(minT);
+            state.lastCoef = coefs[0];
+            state.needsEntry = false;
+        }
 
-            float coef = volume.sampleVolume(pos);
+        for (int i = first; i < count; ++i)
+        {
+            // Exact optical depth of the segment from the last sample, its intensity taken as linear
+            if (settings.preIntegrate)
+            {
+                state.sum += settings.densityScale * settings.transferFunction.getMeanOpacity(state.lastCoef, coefs[i]) * (distances[i] - state.lastT);
+            }
+            else
+            {
+                state.sum += settings.densityScale * settings.transferFunction.evaluate(coefs[i]).w * stepSize;
+            }
 
-            Vec4f out = settings.transferFunction.evaluate(coef);
+            state.lastT = distances[i];
+            state.lastCoef = coefs[i];
 
-            if (sampler.nextFloat() < (out.w * settings.densityScale) * invMaxOpacity * settings.stepSize)
+            if (state.sum >= state.S)
             {
-                intersection.position   = pos;
-                intersection.distance   = minT;
+                intersection.position   = positions[i];
+                intersection.distance   = distances[i];
                 intersection.surfaceType = SurfaceType::Volume;
 
                 return true;
             }
+        }
+    }
+
+    return false;
+}
+
+bool castRayWoodcockFast2(Volume const& volume, Ray ray, Intersection &intersection, Settings const& settings, Sampler &sampler)
+{
+    OctreeTraversal traversal(volume.octree, ray);
 
-            minT += (-std::log(sampler.nextFloat())) * invMaxOpacity * settings.stepSize;
+    MarchState state;
+    state.S = -std::log(sampler.nextFloat()) / settings.densityScale;
+
+    while (traversal.isValid() && ray.minT <= ray.maxT)
+    {
+        OctreeTraversal::Frame const& frame = traversal.current();
+        float minT = std::max(ray.minT, traversal.getMinT(frame));
+        float maxT = std::min(ray.maxT, traversal.getMaxT(frame));
+
+        // Behind the ray or past its end
+        if (minT > maxT)
+        {
+            traversal.skip();
+            continue;
+        }
+
+        float maxOpacity = volume.octree.majorants[frame.node];
+
+        // Skip
+        if (maxOpacity <= 0.0f)
+        {
+            // Jump into next node
+            ray.minT = maxT;
+            state.needsJitter = true;
+
+            // Leap over the empty macrocells around the exit point as well, then resume in the node holding the landing point
+            if (settings.useDistanceField)
+            {
+                float leapT = volume.macrocells.getLeapT(ray, maxT);
+                if (leapT > maxT)
+                {
+                    ray.minT = leapT;
+                    traversal.leap(leapT);
+                    continue;
+                }
+            }
+
+            traversal.skip();
+            continue;
+        }
+
+        // Continue with the children, front to back
+        if (!volume.octree.isLeaf(frame.node))
+        {
+            traversal.descend();
+            continue;
+        }
+
+        // Cast ray inside node
+        volume.prefetch(volume.octree.getBounds(traversal.depth, frame.x, frame.y, frame.z));
+
+        if (marchLeaf(volume, ray, minT, maxT, maxOpacity, state, intersection, settings, sampler))
+        {
+            return true;
         }
 
         // Jump into next node
         ray.minT = minT;
-        st.pop();
+        traversal.skip();
     }
 
     return false;
 }
 
-bool castRayWoodcockFast2(Volume const& volume, Ray ray, Intersection &intersection, Settings const& settings, Sampler &sampler)
+// Lanes of a packet of castRayWoodcockFast2, their directions have the same signs
+struct Packet
 {
-    Vec3f color(0, 0, 0);
+    int count;
+    int mirror; // Signs of the directions, as in OctreeTraversal
+    uint32_t active; // Lanes still marching
 
-    std::stack<State> st;
+    Ray rays[PACKET_SIZE];
+    Vec3f invDirections[PACKET_SIZE];
+    MarchState states[PACKET_SIZE];
+};
 
-    BBIntersection bbIntersection;
-    volume.octree.bb.getIntersection(ray, bbIntersection);
-    if (bbIntersection.valid)
+inline int getMirror(Ray const& ray)
+{
+    return (ray.direction.x < -1e-7f ? 4 : 0) | (ray.direction.y < -1e-7f ? 2 : 0) | (ray.direction.z < -1e-7f ? 1 : 0);
+}
+
+// Visits the node at cell (x, y, z) of a level for the lanes in mask, and its children in an order that is front to back
+// for every lane: with positive directions, a ray never goes from a child back to one of lower index
+void marchPacket(Volume const& volume, Packet &packet, uint32_t node, int level, int x, int y, int z, uint32_t mask,
+                 Intersection *intersections, Settings const& settings, Sampler &sampler)
+{
+    BoundingBox bb = volume.octree.getBounds(level, x, y, z);
+
+    // The box is tested once per node against every lane
+    float minT[PACKET_SIZE];
+    float maxT[PACKET_SIZE];
+    for (int lane = 0; lane < packet.count; ++lane)
     {
-        st.push(State(&volume.octree, bbIntersection.nearT, bbIntersection.farT));
+        Ray const& ray = packet.rays[lane];
+        Vec3f t0 = (bb.min - ray.origin) * packet.invDirections[lane];
+        Vec3f t1 = (bb.max - ray.origin) * packet.invDirections[lane];
+
+        minT[lane] = std::max(ray.minT, std::max(std::max(std::min(t0.x, t1.x), std::min(t0.y, t1.y)), std::min(t0.z, t1.z)));
+        maxT[lane] = std::min(ray.maxT, std::min(std::min(std::max(t0.x, t1.x), std::max(t0.y, t1.y)), std::max(t0.z, t1.z)));
+
+        if (minT[lane] > maxT[lane])
+        {
+            mask &= ~(1u << lane);
+        }
     }
 
-    float S = -std::log(sampler.nextFloat()) / settings.densityScale;
-    float sum = 0.0f;
+    mask &= packet.active;
+    if (mask == 0)
+    {
+        return;
+    }
 
-    bool needsJitter = true;
+    float maxOpacity = volume.octree.majorants[node];
 
-    while (!st.empty() && ray.minT <= ray.maxT)
+    // Skip
+    if (maxOpacity <= 0.0f)
     {
-        State &state = st.top();
-        Octree const* node = state.node;
+        for (int lane = 0; lane < packet.count; ++lane)
+        {
+            if (mask & (1u << lane))
+            {
+                packet.rays[lane].minT = maxT[lane];
+                packet.states[lane].needsJitter = true;
+            }
+        }
 
-        float minT = std::max(ray.minT, state.minT);
-        float maxT = std::min(ray.maxT, state.maxT);
+        return;
+    }
 
-        // Ray was moved by a previous node
-        if (minT > maxT)
+    // Continue with the children
+    if (!volume.octree.isLeaf(node))
+    {
+        for (int child = 0; child < 8 && (mask & packet.active); ++child)
+        {
+            int id = child ^ packet.mirror;
+
+            marchPacket(volume, packet, volume.octree.nodes[node].children + id, level + 1,
+                        2 * x + ((id >> 2) & 1), 2 * y + ((id >> 1) & 1), 2 * z + (id & 1), mask & packet.active,
+                        intersections, settings, sampler);
+        }
+
+        return;
+    }
+
+    // Cast the rays inside the node one by one
+    volume.prefetch(bb);
+
+    for (int lane = 0; lane < packet.count; ++lane)
+    {
+        if (!(mask & (1u << lane)))
         {
-            st.pop();
             continue;
         }
 
-        // Skip
-        if (!(node->mask & settings.mask))
+        Ray &ray = packet.rays[lane];
+        if (marchLeaf(volume, ray, minT[lane], maxT[lane], maxOpacity, packet.states[lane], intersections[lane], settings, sampler))
         {
-            // Jump into next node
-            ray.minT = maxT + dT;
-            needsJitter = true;
-            st.pop();
+            packet.active &= ~(1u << lane);
             continue;
         }
 
-        // Continue 'recursively'
-        if (!node->isLeaf)
+        // Jump into next node
+        ray.minT = minT[lane];
+    }
+}
+
+void castRayWoodcockFast2Packet(Volume const& volume, Ray const* rays, Intersection *intersections, bool *hits, int count,
+                                Settings const& settings, Sampler &sampler)
+{
+    // Lanes only share the order of the children when their directions share their signs
+    int mirror = getMirror(rays[0]);
+    for (int lane = 1; lane < count; ++lane)
+    {
+        if (getMirror(rays[lane]) != mirror)
         {
-            // Find first child
-            while(minT <= maxT)
+            for (lane = 0; lane < count; ++lane)
             {
-                Vec3f mid = node->bb.mid;
-                Vec3f entry = ray(minT);
-                Vec3f dist = entry - mid;
+                hits[lane] = castRayWoodcockFast2(volume, rays[lane], intersections[lane], settings, sampler);
+            }
 
-                bool sideX = dist.x >= 0;
-                bool sideY = dist.y >= 0;
-                bool sideZ = dist.z >= 0;
+            return;
+        }
+    }
 
-                int id = (sideX << 2) | (sideY << 1) | (sideZ);
+    Packet packet;
+    packet.count = count;
+    packet.mirror = mirror;
+    packet.active = (1u << count) - 1;
 
-                // We need to jump over
-                if (state.nodesMask & (1 << id))
-                {
-                    minT += dT;
-                    ray.minT = minT + dT;
-                    needsJitter = true;
-                    continue;
-                }
+    for (int lane = 0; lane < count; ++lane)
+    {
+        packet.rays[lane] = rays[lane];
 
-                node->nodes[id]->bb.getIntersection(ray, bbIntersection);
-                state.nodesMask &= (1 << id);
+        // Parallel rays get a tiny slope instead of infinite distances
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float direction = rays[lane].direction.data[axis];
+            if (std::fabs(direction) < 1e-7f)
+            {
+                direction = 1e-7f;
+            }
 
-                // We need to jump over
-                if (!bbIntersection.valid)
-                {
-                    minT += dT;
-                    ray.minT = minT + dT;
-                    needsJitter = true;
-                    continue;
-                }
+            packet.invDirections[lane].data[axis] = 1.0f / direction;
+        }
+
+        packet.states[lane].S = -std::log(sampler.nextFloat()) / settings.densityScale;
+    }
+
+    marchPacket(volume, packet, 0, 0, 0, 0, 0, packet.active, intersections, settings, sampler);
+
+    for (int lane = 0; lane < count; ++lane)
+    {
+        hits[lane] = !(packet.active & (1u << lane));
+    }
+}
 
-                st.push(State(node->nodes[id], bbIntersection.nearT, bbIntersection.farT));
-                break;
+bool castRayWoodcockGrid(Volume const& volume, Ray const& ray, Intersection &intersection, Settings const& settings, Sampler &sampler)
+{
+    MacrocellGrid const& grid = volume.macrocells;
+
+    BBIntersection bbIntersection;
+    volume.octree.bb.getIntersection(ray, bbIntersection);
+
+    float minT = std::max(ray.minT, bbIntersection.nearT);
+    float maxT = std::min(ray.maxT, bbIntersection.farT);
+
+    if (!bbIntersection.valid || minT > maxT)
+    {
+        return false;
+    }
+
+    int min[3] = {0, 0, 0};
+    int max[3] = {grid.width - 1, grid.height - 1, grid.depth - 1};
+    GridDDA cells(ray, minT, 0.0f, MACROCELL_SIZE, min, max);
+
+    do
+    {
+        float cellMaxT = std::min(cells.getMaxT(), maxT);
+        float majorant = getMajorant(settings, grid.majorants[grid.getIndex(cells.cell[0], cells.cell[1], cells.cell[2])]);
+
+        if (majorant > 0.0f)
+        {
+            volume.prefetch(grid.getBounds(cells.cell[0], cells.cell[1], cells.cell[2]));
+
+            if (trackSegment(volume, ray, cells.minT, cellMaxT, majorant, intersection, settings, sampler))
+            {
+                return true;
             }
+        }
+    }
+    while (cells.getMaxT() < maxT && cells.next());
+
+    return false;
+}
+
+void castRayWoodcockGridN(Volume const& volume, Ray const* rays, Intersection *intersections, uint8_t *hits, int count,
+                          Settings const& settings, Sampler &sampler)
+{
+    MacrocellGrid const& grid = volume.macrocells;
+
+    int min[3] = {0, 0, 0};
+    int max[3] = {grid.width - 1, grid.height - 1, grid.depth - 1};
+
+    // Traversal of every ray, indexed as the rays
+    GridDDA cells[TRACK_BATCH];
+    float maxT[TRACK_BATCH];
+
+    // Rays still tracked, with their state kept contiguous so that every round runs flat loops over it
+    int active[TRACK_BATCH];
+    int activeCount = 0;
+
+    alignas(32) float originX[TRACK_BATCH];
+    alignas(32) float originY[TRACK_BATCH];
+    alignas(32) float originZ[TRACK_BATCH];
+    alignas(32) float directionX[TRACK_BATCH];
+    alignas(32) float directionY[TRACK_BATCH];
+    alignas(32) float directionZ[TRACK_BATCH];
+    alignas(32) float distances[TRACK_BATCH];    // Tentative collision
+    alignas(32) float cellMaxT[TRACK_BATCH];     // Exit of the current cell
+    alignas(32) float invMajorants[TRACK_BATCH]; // Of the current cell
+
+    alignas(32) float x[TRACK_BATCH];
+    alignas(32) float y[TRACK_BATCH];
+    alignas(32) float z[TRACK_BATCH];
+    alignas(32) float coefs[TRACK_BATCH];
+    alignas(32) float opacities[TRACK_BATCH];
+    alignas(32) float accepts[TRACK_BATCH];
+    alignas(32) float flights[TRACK_BATCH];
+
+    // Moves ray i, in slot k, from t to its first tentative collision past the end of its current cell
+    // Free flights restart at every cell, as in trackSegment. False once the ray left the volume
+    auto crossCells = [&](int i, int k, float t)
+    {
+        GridDDA &dda = cells[i];
+
+        while (t > cellMaxT[k])
+        {
+            if (dda.getMaxT() >= maxT[i] || !dda.next())
+            {
+                return false;
+            }
+
+            float majorant = getMajorant(settings, grid.majorants[grid.getIndex(dda.cell[0], dda.cell[1], dda.cell[2])]);
+
+            cellMaxT[k] = std::min(dda.getMaxT(), maxT[i]);
+            t = INF;
+
+            if (majorant > 0.0f)
+            {
+                volume.prefetch(grid.getBounds(dda.cell[0], dda.cell[1], dda.cell[2]));
+
+                invMajorants[k] = 1.0f / majorant;
+                t = dda.minT + (-std::log(sampler.nextFloat())) * invMajorants[k];
+            }
+        }
+
+        distances[k] = t;
+        return true;
+    };
+
+    for (int i = 0; i < count; ++i)
+    {
+        hits[i] = false;
 
+        BBIntersection bbIntersection;
+        volume.octree.bb.getIntersection(rays[i], bbIntersection);
+
+        float minT = std::max(rays[i].minT, bbIntersection.nearT);
+        maxT[i] = std::min(rays[i].maxT, bbIntersection.farT);
+
+        if (!bbIntersection.valid || minT > maxT[i])
+        {
             continue;
         }
 
-        // Cast ray inside node
-//*
-        float maxOpacity = 0.0f;
-        for (int i = 0; i < (int)settings.maxOpacity.size(); ++i)
+        int k = activeCount;
+
+        originX[k] = rays[i].origin.x;
+        originY[k] = rays[i].origin.y;
+        originZ[k] = rays[i].origin.z;
+        directionX[k] = rays[i].direction.x;
+        directionY[k] = rays[i].direction.y;
+        directionZ[k] = rays[i].direction.z;
+
+        // Free flight in the first cell, crossCells moves on when it leaves it
+        cells[i] = GridDDA(rays[i], minT, 0.0f, MACROCELL_SIZE, min, max);
+
+        float majorant = getMajorant(settings, grid.majorants[grid.getIndex(cells[i].cell[0], cells[i].cell[1], cells[i].cell[2])]);
+        float t = INF;
+
+        if (majorant > 0.0f)
         {
-            if (node->mask & (1 << i) && settings.maxOpacity[i] > maxOpacity)
+            volume.prefetch(grid.getBounds(cells[i].cell[0], cells[i].cell[1], cells[i].cell[2]));
+
+            invMajorants[k] = 1.0f / majorant;
+            t = minT + (-std::log(sampler.nextFloat())) * invMajorants[k];
+        }
+
+        cellMaxT[k] = std::min(cells[i].getMaxT(), maxT[i]);
+
+        if (crossCells(i, k, t))
+        {
+            active[activeCount++] = i;
+        }
+    }
+
+    // Every round samples the tentative collisions of all the rays together
+    while (activeCount > 0)
+    {
+        for (int k = 0; k < activeCount; ++k)
+        {
+            x[k] = originX[k] + directionX[k] * distances[k];
+            y[k] = originY[k] + directionY[k] * distances[k];
+            z[k] = originZ[k] + directionZ[k] * distances[k];
+        }
+
+        volume.sampleVolumeN(x, y, z, coefs, activeCount);
+        settings.transferFunction.evaluateOpacityN(coefs, opacities, activeCount);
+
+        // The free flight past a rejected collision is drawn for every ray
+        for (int k = 0; k < activeCount; ++k)
+        {
+            accepts[k] = sampler.nextFloat();
+            flights[k] = sampler.nextFloat();
+        }
+
+        for (int k = 0; k < activeCount; ++k)
+        {
+            accepts[k] = accepts[k] - opacities[k] * settings.densityScale * invMajorants[k];
+            flights[k] = distances[k] - std::log(flights[k]) * invMajorants[k];
+        }
+
+        int remaining = 0;
+        for (int k = 0; k < activeCount; ++k)
+        {
+            int i = active[k];
+
+            if (accepts[k] < 0.0f)
+            {
+                intersections[i].position   = Vec3f(x[k], y[k], z[k]);
+                intersections[i].distance   = distances[k];
+                intersections[i].surfaceType = SurfaceType::Volume;
+                hits[i] = true;
+
+                continue;
+            }
+
+            // Slots only move down, the state of k is read before it is overwritten
+            originX[remaining] = originX[k];
+            originY[remaining] = originY[k];
+            originZ[remaining] = originZ[k];
+            directionX[remaining] = directionX[k];
+            directionY[remaining] = directionY[k];
+            directionZ[remaining] = directionZ[k];
+            cellMaxT[remaining] = cellMaxT[k];
+            invMajorants[remaining] = invMajorants[k];
+
+            if (crossCells(i, remaining, flights[k]))
             {
-                maxOpacity = settings.maxOpacity[i];
+                active[remaining++] = i;
             }
         }
 
-        float stepSize = lerp(1.0f, settings.stepSize, clamp(0.0f, 1.0f, settings.densityScale * maxOpacity));
-//*/
-        if (needsJitter)
+        activeCount = remaining;
+    }
+}
+
+bool castRayWoodcockTree(Volume const& volume, Ray const& ray, Intersection &intersection, Settings const& settings, Sampler &sampler)
+{
+    if (volume.layout != VolumeLayout::Sparse)
+    {
+        return castRayWoodcockGrid(volume, ray, intersection, settings, sampler);
+    }
+
+    SparseTree const& tree = volume.tree;
+
+    BBIntersection bbIntersection;
+    volume.octree.bb.getIntersection(ray, bbIntersection);
+
+    float minT = std::max(ray.minT, bbIntersection.nearT);
+    float maxT = std::min(ray.maxT, bbIntersection.farT);
+
+    if (!bbIntersection.valid || minT > maxT)
+    {
+        return false;
+    }
+
+    // Cells are offset by half a voxel, samples inside a brick then only read its voxels
+    int nodeMin[3] = {0, 0, 0};
+    int nodeMax[3] = {tree.width - 1, tree.height - 1, tree.depth - 1};
+    int brickCount[3] = {volume.bricksX, volume.bricksY, volume.bricksZ};
+    GridDDA nodes(ray, minT, 0.5f, BRICK_SIZE * SPARSE_NODE_SIZE, nodeMin, nodeMax);
+
+    do
+    {
+        float nodeMaxT = std::min(nodes.getMaxT(), maxT);
+        uint32_t node = tree.root[((size_t)nodes.cell[0] * tree.height + nodes.cell[1]) * tree.depth + nodes.cell[2]];
+
+        // Descend into the bricks of nodes that are not empty
+        if (tree.nodeMajorants[node] <= 0.0f)
         {
-            minT += sampler.nextFloat() * stepSize - dT;
-            needsJitter = false;
+            continue;
         }
 
-        while (minT <= maxT)
+        int brickMin[3];
+        int brickMax[3];
+        for (int axis = 0; axis < 3; ++axis)
         {
-            Vec3f pos = ray(minT);
+            brickMin[axis] = nodes.cell[axis] << SPARSE_NODE_BITS;
+            brickMax[axis] = std::min(brickMin[axis] + SPARSE_NODE_MASK, brickCount[axis] - 1);
+        }
+
+        GridDDA bricks(ray, nodes.minT, 0.5f, BRICK_SIZE, brickMin, brickMax);
 
-            float coef = volume.sampleVolume(pos);
+        do
+        {
+            float brickMaxT = std::min(bricks.getMaxT(), nodeMaxT);
 
-            Vec4f out = settings.transferFunction.evaluate(coef);
+            int local = ((bricks.cell[0] & SPARSE_NODE_MASK) << SPARSE_NODE_BITS | (bricks.cell[1] & SPARSE_NODE_MASK)) << SPARSE_NODE_BITS |
+                        (bricks.cell[2] & SPARSE_NODE_MASK);
+            size_t brick = (size_t)node * SPARSE_NODE_BRICKS + local;
+            float majorant = getMajorant(settings, tree.brickMajorants[brick]);
 
-            sum += settings.densityScale * out.w * stepSize;
+            if (majorant <= 0.0f)
+            {
+                continue;
+            }
 
-            if (sum >= S)
+            // Inactive bricks are constant, collisions are accepted with the same probability everywhere and no voxel is read
+            // The majorant can exceed the opacity of the value when a node of the transfer function is close to it
+            if (!((tree.nodes[node].mask[local >> 6] >> (local & 63)) & 1))
             {
-                intersection.position   = pos;
-                intersection.distance   = minT;
-                intersection.surfaceType = SurfaceType::Volume;
+                float probability = settings.densityScale * settings.transferFunction.evaluate(tree.ranges[brick].min).w / majorant;
+                float t = bricks.minT + (-std::log(sampler.nextFloat())) / majorant;
 
-                return true;
+                while (t <= brickMaxT && sampler.nextFloat() >= probability)
+                {
+                    t += (-std::log(sampler.nextFloat())) / majorant;
+                }
+
+                if (t <= brickMaxT)
+                {
+                    intersection.position   = ray(t);
+                    intersection.distance   = t;
+                    intersection.surfaceType = SurfaceType::Volume;
+
+                    return true;
+                }
+
+                continue;
             }
 
-            minT += stepSize;
-        }
+            Vec3f brickMinBounds = Vec3f(bricks.cell[0], bricks.cell[1], bricks.cell[2]) * (float)BRICK_SIZE + Vec3f(0.5f);
+            volume.prefetch(BoundingBox(brickMinBounds, brickMinBounds + Vec3f((float)BRICK_SIZE)));
 
-        // Jump into next node
-        ray.minT = minT;
-        st.pop();
+            if (trackSegment(volume, ray, bricks.minT, brickMaxT, majorant, intersection, settings, sampler))
+            {
+                return true;
+            }
+        }
+        while (bricks.getMaxT() < nodeMaxT && bricks.next());
     }
+    while (nodes.getMaxT() < maxT && nodes.next());
 
     return false;
 }
@@ -340,15 +867,6 @@ bool castRayWoodcockFast2(Volume const& volume, Ray ray, Intersection &intersect
 
 // castRayWoodcock2 last case, try to skip before starting raymarching
 /*
-        float maxOpacity = 0.0f;
-        for (int i = 0; i < (int)settings.maxOpacity.size(); ++i)
-        {
-            if (node->mask & (1 << i) && settings.maxOpacity[i] > maxOpacity)
-            {
-                maxOpacity = settings.maxOpacity[i];
-            }
-        }
-
         float stepCount = 1.0f + std::floor((maxT - minT) / settings.stepSize);
         float stepSum = settings.densityScale * 1 * settings.stepSize;
         //if (maxOpacity * (maxT - minT) / settings.stepSize < S)
@@ -357,9 +875,9 @@ bool castRayWoodcockFast2(Volume const& volume, Ray ray, Intersection &intersect
             // Jump into next node
             sum += stepCount * stepSum;
 
-            ray.minT = maxT + dT;
+            ray.minT = maxT;
             needsJitter = true;
-            st.pop();
+            traversal.skip();
             continue;
         }
 //*/
\ No newline at end of file
@@ -8,6 +8,14 @@
 #include "vector_type.h"
 #include "volume.h"
 
+#include <cstdint>
+
+// Camera rays traced together by castRayWoodcockFast2Packet
+#define PACKET_SIZE 8
+
+// Most rays tracked together by castRayWoodcockGridN
+#define TRACK_BATCH 256
+
 namespace scg
 {
 
@@ -17,6 +25,21 @@ bool castRayWoodcockFast(Volume const& volume, Ray ray, Intersection &intersecti
 
 bool castRayWoodcockFast2(Volume const& volume, Ray ray, Intersection &intersection, Settings const& settings, Sampler &sampler);
 
+// castRayWoodcockFast2 for up to PACKET_SIZE rays, which share the visits of the octree nodes until they scatter
+void castRayWoodcockFast2Packet(Volume const& volume, Ray const* rays, Intersection *intersections, bool *hits, int count,
+                                Settings const& settings, Sampler &sampler);
+
+// Delta tracking through the macrocell grid, with the majorant of every cell
+bool castRayWoodcockGrid(Volume const& volume, Ray const& ray, Intersection &intersection, Settings const& settings, Sampler &sampler);
+
+// castRayWoodcockGrid for up to TRACK_BATCH rays in lockstep, the next tentative collisions of all the rays still
+// tracked are sampled together
+void castRayWoodcockGridN(Volume const& volume, Ray const* rays, Intersection *intersections, uint8_t *hits, int count,
+                          Settings const& settings, Sampler &sampler);
+
+// Delta tracking through the nodes and bricks of the sparse tree, other layouts use the macrocell grid
+bool castRayWoodcockTree(Volume const& volume, Ray const& ray, Intersection &intersection, Settings const& settings, Sampler &sampler);
+
 Vec3f singleScatter(Volume const&, Ray const&, Settings const& settings, Sampler &sampler);
 
 }
@@ -7,6 +7,7 @@
 #include "scatterevent.h"
 #include "vector_type.h"
 
+#include <algorithm>
 #include <cassert>
 #include <limits>
 
@@ -31,37 +32,116 @@ inline void getBounds(Ray &ray, Settings const& settings)
     }
 }
 
-bool getClosestIntersection(
+// Traced in the voxel coordinates of the level, scaling the direction as well keeps the distances
+inline Ray getVolumeRay(Scene const& scene, Volume const& volume, Ray const& ray, Settings const& settings)
+{
+    Ray volumeRay = ray;
+    if (settings.useBox)
+    {
+        getBounds(volumeRay, settings);
+    }
+    volumeRay.origin -= scene.volumePos;
+
+    volumeRay.origin = volume.toVoxel(volumeRay.origin);
+    volumeRay.direction /= volume.spacing;
+
+    return volumeRay;
+}
+
+bool castVolume(
     Scene const& scene,
     Ray const& ray,
-    Intersection &closestIntersection,
+    Intersection &intersection,
     Settings const& settings,
-    Sampler &sampler)
+    Sampler &sampler,
+    int level)
 {
-    float minDistance = std::numeric_limits<float>::max();
-    int index = -1;
+    if (!scene.volume)
+    {
+        return false;
+    }
 
-    Intersection intersection;
+    Volume const& volume = scene.volume->getLevel(level);
+    Ray volumeRay = getVolumeRay(scene, volume, ray, settings);
+
+    if ((settings.renderType == 0 && castRayWoodcock(volume, volumeRay, intersection, settings, sampler)) ||
+        (settings.renderType == 1 && castRayWoodcockFast(volume, volumeRay, intersection, settings, sampler)) ||
+        (settings.renderType == 2 && castRayWoodcockFast2(volume, volumeRay, intersection, settings, sampler)) ||
+        (settings.renderType == 3 && castRayWoodcockGrid(volume, volumeRay, intersection, settings, sampler)) ||
+        (settings.renderType == 4 && castRayWoodcockTree(volume, volumeRay, intersection, settings, sampler)))
+    {
+        intersection.position = volume.fromVoxel(intersection.position) + scene.volumePos;
+        intersection.objectID = (int)scene.objects.size();
+
+        return true;
+    }
+
+    return false;
+}
+
+void castVolumeN(
+    Scene const& scene,
+    Ray const* rays,
+    int const* paths,
+    int count,
+    Intersection *intersections,
+    uint8_t *hits,
+    Settings const& settings,
+    Sampler &sampler,
+    int level)
+{
+    if (!scene.volume)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            hits[paths[i]] = false;
+        }
+
+        return;
+    }
 
-    if (scene.volume)
+    Volume const& volume = scene.volume->getLevel(level);
+
+    Ray volumeRays[TRACK_BATCH];
+    Intersection volumeIntersections[TRACK_BATCH];
+    uint8_t volumeHits[TRACK_BATCH];
+
+    for (int first = 0; first < count; first += TRACK_BATCH)
     {
-        Ray volumeRay = ray;
-        if (settings.useBox)
+        int batch = std::min(TRACK_BATCH, count - first);
+
+        for (int i = 0; i < batch; ++i)
         {
-            getBounds(volumeRay, settings);
+            volumeRays[i] = getVolumeRay(scene, volume, rays[paths[first + i]], settings);
         }
-        volumeRay.origin -= scene.volumePos;
 
-        if ((settings.renderType == 0 && castRayWoodcock(*scene.volume, volumeRay, intersection, settings, sampler)) ||
-            (settings.renderType == 1 && castRayWoodcockFast(*scene.volume, volumeRay, intersection, settings, sampler)) ||
-            (settings.renderType == 2 && castRayWoodcockFast2(*scene.volume, volumeRay, intersection, settings, sampler)))
+        castRayWoodcockGridN(volume, volumeRays, volumeIntersections, volumeHits, batch, settings, sampler);
+
+        for (int i = 0; i < batch; ++i)
         {
-            minDistance = intersection.distance;
-            index = (int) scene.objects.size();
-            closestIntersection = intersection;
-            closestIntersection.position += scene.volumePos;
+            int path = paths[first + i];
+
+            hits[path] = volumeHits[i];
+            if (volumeHits[i])
+            {
+                intersections[path] = volumeIntersections[i];
+                intersections[path].position = volume.fromVoxel(intersections[path].position) + scene.volumePos;
+                intersections[path].objectID = (int)scene.objects.size();
+            }
         }
     }
+}
+
+bool castObjects(
+    Scene const& scene,
+    Ray const& ray,
+    Intersection &closestIntersection,
+    float maxDistance)
+{
+    float minDistance = maxDistance;
+    int index = -1;
+
+    Intersection intersection;
 
     for (int i = 0; i < (int)scene.objects.size(); ++i)
     {
@@ -86,4 +166,64 @@ bool getClosestIntersection(
     return true;
 }
 
-}
\ No newline at end of file
+bool getClosestIntersection(
+    Scene const& scene,
+    Ray const& ray,
+    Intersection &closestIntersection,
+    Settings const& settings,
+    Sampler &sampler,
+    int level)
+{
+    bool hitVolume = castVolume(scene, ray, closestIntersection, settings, sampler, level);
+    float maxDistance = hitVolume ? closestIntersection.distance : std::numeric_limits<float>::max();
+
+    return castObjects(scene, ray, closestIntersection, maxDistance) || hitVolume;
+}
+
+void getClosestIntersectionPacket(
+    Scene const& scene,
+    Ray const* rays,
+    Intersection *intersections,
+    bool *hits,
+    int count,
+    Settings const& settings,
+    Sampler &sampler)
+{
+    // Only castRayWoodcockFast2 has a packet traversal
+    if (!settings.usePackets || !scene.volume || settings.renderType != 2)
+    {
+        for (int lane = 0; lane < count; ++lane)
+        {
+            hits[lane] = getClosestIntersection(scene, rays[lane], intersections[lane], settings, sampler);
+        }
+
+        return;
+    }
+
+    Volume const& volume = *scene.volume;
+
+    Ray volumeRays[PACKET_SIZE];
+    for (int lane = 0; lane < count; ++lane)
+    {
+        volumeRays[lane] = getVolumeRay(scene, volume, rays[lane], settings);
+    }
+
+    castRayWoodcockFast2Packet(volume, volumeRays, intersections, hits, count, settings, sampler);
+
+    for (int lane = 0; lane < count; ++lane)
+    {
+        if (hits[lane])
+        {
+            intersections[lane].position = volume.fromVoxel(intersections[lane].position) + scene.volumePos;
+            intersections[lane].objectID = (int)scene.objects.size();
+        }
+
+        float maxDistance = hits[lane] ? intersections[lane].distance : std::numeric_limits<float>::max();
+        if (castObjects(scene, rays[lane], intersections[lane], maxDistance))
+        {
+            hits[lane] = true;
+        }
+    }
+}
+
+}
@@ -2,22 +2,64 @@
 #define RAYTRACE_H
 
 #include "intersection.h"
+#include "raycast.h"
 #include "sampler.h"
 #include "scene.h"
 #include "settings.h"
 #include "vector_type.h"
 #include "ray.h"
 
+#include <cstdint>
 #include <vector>
 
 namespace scg
 {
 
+// Delta tracking through the volume, with the tracker of settings.renderType
+bool castVolume(
+    Scene const& scene,
+    Ray const& ray,
+    Intersection& intersection,
+    Settings const& settings,
+    Sampler &sampler,
+    int level = 0);
+
+// Delta tracking of the rays of the given paths through the volume, in lockstep through the macrocell grid whatever
+// the renderType. Rays, intersections and hits are indexed by path
+void castVolumeN(
+    Scene const& scene,
+    Ray const* rays,
+    int const* paths,
+    int count,
+    Intersection *intersections,
+    uint8_t *hits,
+    Settings const& settings,
+    Sampler &sampler,
+    int level = 0);
+
+// Closest object hit before maxDistance
+bool castObjects(
+    Scene const& scene,
+    Ray const& ray,
+    Intersection& closestIntersection,
+    float maxDistance);
+
 bool getClosestIntersection(
     Scene const& scene,
     Ray const& ray,
     Intersection& closestIntersection,
     Settings const& settings,
+    Sampler &sampler,
+    int level = 0);
+
+// getClosestIntersection for up to PACKET_SIZE rays, traced as a packet through the volume when possible
+void getClosestIntersectionPacket(
+    Scene const& scene,
+    Ray const* rays,
+    Intersection *intersections,
+    bool *hits,
+    int count,
+    Settings const& settings,
     Sampler &sampler);
 
 }
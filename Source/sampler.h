@@ -6,7 +6,8 @@
 namespace scg
 {
 
-class Sampler
+// Every thread draws from its own sampler, a cache line each keeps them from sharing lines in arrays of samplers
+class alignas(64) Sampler
 {
 private:
     std::default_random_engine generator;
@@ -18,6 +19,12 @@ public:
         distribution = std::uniform_real_distribution<float>(0, 1);
     }
 
+    explicit Sampler(unsigned int seed):
+        generator(seed)
+    {
+        distribution = std::uniform_real_distribution<float>(0, 1);
+    }
+
     float nextFloat()
     {
         return distribution(generator);
@@ -0,0 +1,94 @@
+#include "scheduler.h"
+
+#include "math_utils.h"
+
+#include <algorithm>
+
+namespace scg
+{
+
+TileScheduler::TileScheduler(int width, int height):
+    width(width), height(height)
+{
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+    for (int y = 0; y < tilesY; ++y)
+    {
+        for (int x = 0; x < tilesX; ++x)
+        {
+            tiles.push_back(Tile{
+                x * TILE_SIZE,
+                y * TILE_SIZE,
+                std::min(TILE_SIZE, width - x * TILE_SIZE),
+                std::min(TILE_SIZE, height - y * TILE_SIZE)});
+        }
+    }
+
+    // Neighbouring tiles touch the same bricks, keep them close in the runs of the workers
+    std::sort(tiles.begin(), tiles.end(), [](Tile const& a, Tile const& b)
+    {
+        return mortonEncode((uint32_t)a.x, (uint32_t)a.y, 0) < mortonEncode((uint32_t)b.x, (uint32_t)b.y, 0);
+    });
+
+    workerCount = omp_get_max_threads();
+    queues.reset(new Queue[workerCount]);
+    buffers.resize((size_t)workerCount);
+
+    // Distinct sequences, the default seed would give every worker the same
+    samplers.reserve((size_t)workerCount);
+    for (int worker = 0; worker < workerCount; ++worker)
+    {
+        samplers.emplace_back((unsigned int)worker + 1);
+    }
+}
+
+void TileScheduler::distribute()
+{
+    int count = (int)tiles.size();
+
+    for (int worker = 0; worker < workerCount; ++worker)
+    {
+        Queue &queue = queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        queue.tiles.clear();
+        for (int index = count * worker / workerCount; index < count * (worker + 1) / workerCount; ++index)
+        {
+            queue.tiles.push_back(index);
+        }
+    }
+}
+
+bool TileScheduler::next(int worker, int &index)
+{
+    {
+        Queue &queue = queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (!queue.tiles.empty())
+        {
+            index = queue.tiles.front();
+            queue.tiles.pop_front();
+            return true;
+        }
+    }
+
+    // Steal the tile the victim would reach last, starting with the next worker
+    for (int i = 1; i < workerCount; ++i)
+    {
+        Queue &victim = queues[(worker + i) % workerCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        if (!victim.tiles.empty())
+        {
+            index = victim.tiles.back();
+            victim.tiles.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+}
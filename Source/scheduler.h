@@ -0,0 +1,103 @@
+#ifndef RAYTRACER_SCHEDULER_H
+#define RAYTRACER_SCHEDULER_H
+
+#include "sampler.h"
+#include "vector_type.h"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <omp.h>
+#include <vector>
+
+// Tiles are squares of TILE_SIZE pixels, cut at the border of the image
+#define TILE_SIZE 16
+
+namespace scg
+{
+
+struct Tile
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Renders an image tile by tile on the OpenMP threads
+// Every worker starts from its own run of tiles in Morton order, then steals from the back of the others
+class TileScheduler
+{
+public:
+    int width;
+    int height;
+
+    std::vector<Tile> tiles;       // Morton order
+    std::vector<Sampler> samplers; // One per worker, indexed by thread
+
+    TileScheduler(int width, int height);
+
+    TileScheduler(TileScheduler const&) = delete;
+    TileScheduler& operator =(TileScheduler const&) = delete;
+
+    // Calls renderTile(tile, colours, sampler) for every tile, colours holds the pixels of the tile row by row
+    // The colours are then added to image, stored row by row
+    template<typename RenderTile>
+    void run(RenderTile const& renderTile, Vec3f *image)
+    {
+        distribute();
+
+        #pragma omp parallel num_threads(workerCount)
+        {
+            int worker = omp_get_thread_num();
+            Vec3f *colours = buffers[worker].colours;
+
+            int index;
+            while (next(worker, index))
+            {
+                Tile const& tile = tiles[index];
+                std::fill(colours, colours + TILE_SIZE * TILE_SIZE, Vec3f(0.0f, 0.0f, 0.0f));
+
+                renderTile(tile, colours, samplers[worker]);
+
+                // Tiles do not overlap, nothing else writes these pixels
+                for (int y = 0; y < tile.height; ++y)
+                {
+                    for (int x = 0; x < tile.width; ++x)
+                    {
+                        image[(size_t)(tile.y + y) * width + tile.x + x] += colours[y * tile.width + x];
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    // Locked by its worker for every tile, a cache line each as for the samplers
+    struct alignas(64) Queue
+    {
+        std::mutex mutex;
+        std::deque<int> tiles;
+    };
+
+    // Colours of the tile being rendered by a worker, kept between frames
+    struct alignas(64) TileBuffer
+    {
+        Vec3f colours[TILE_SIZE * TILE_SIZE];
+    };
+
+    int workerCount;
+    std::unique_ptr<Queue[]> queues;
+    std::vector<TileBuffer> buffers;
+
+    // Splits the tiles between the workers in contiguous runs
+    void distribute();
+
+    // Takes the next tile of the worker, or steals one, false once every tile is taken
+    bool next(int worker, int &index);
+};
+
+}
+
+#endif //RAYTRACER_SCHEDULER_H
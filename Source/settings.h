@@ -1,6 +1,7 @@
 #ifndef RAYTRACER_SETTINGS_H
 #define RAYTRACER_SETTINGS_H
 
+#include "enums.h"
 #include "transferfunction.h"
 #include "vector_type.h"
 
@@ -28,14 +29,25 @@ public:
     float gradientFactor;
 
     int octreeLevels;
+    VolumeLayout volumeLayout;
+    float sparseThreshold; // Sparse bricks at or below this intensity are dropped
+    VoxelFormat voxelFormat;
 
-    TransferFunction transferFunction;
+    int mipLevels;      // Coarser levels built at load time
+    int shadowMipLevel; // Level sampled by shadow rays
+    int bounceMipLevel; // Level sampled by bounces from bounceMipDepth on
+    int bounceMipDepth;
+
+    bool useDistanceField; // Leap over empty macrocells in castRayWoodcockFast2
+    bool preIntegrate;     // Exact optical depth between the samples of castRayWoodcockFast2
 
-    std::vector<float> brackets;
-    std::vector<float> maxOpacity;
-    std::vector<float> minStepSize;
+    bool useWavefront; // Render with the wavefront stages instead of trace, tracking the volume as renderType 3
+    bool usePackets;   // Trace camera rays in packets, with renderType 2
 
-    int mask;
+    bool useCache;      // Map volumes from a cache file, rebuilt when out of date
+    int brickCacheSize; // Resident bricks of a cached volume, in MB
+
+    TransferFunction transferFunction;
 };
 
 }
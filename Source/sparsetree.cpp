@@ -0,0 +1,32 @@
+#include "sparsetree.h"
+
+#include "transferfunction.h"
+
+namespace scg
+{
+
+size_t SparseTree::getMemoryUsage() const
+{
+    return root.size() * sizeof(uint32_t) + nodes.size() * sizeof(SparseNode) +
+           bricks.size() * sizeof(uint32_t) + ranges.size() * sizeof(Macrocell) +
+           (nodeMajorants.size() + brickMajorants.size()) * sizeof(float);
+}
+
+void SparseTree::updateMajorants(TransferFunction const& transferFunction)
+{
+    nodeMajorants.resize(nodes.size());
+    brickMajorants.resize(ranges.size());
+
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        nodeMajorants[i] = transferFunction.getMaxOpacity(nodes[i].min, nodes[i].max);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < (int)ranges.size(); ++i)
+    {
+        brickMajorants[i] = transferFunction.getMaxOpacity(ranges[i].min, ranges[i].max);
+    }
+}
+
+}
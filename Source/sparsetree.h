@@ -0,0 +1,62 @@
+#ifndef RAYTRACER_SPARSETREE_H
+#define RAYTRACER_SPARSETREE_H
+
+#include "macrocellgrid.h"
+#include "transferfunction.h"
+
+#include <cstdint>
+#include <vector>
+
+// Internal nodes of the sparse tree cover cubes of SPARSE_NODE_SIZE bricks
+#define SPARSE_NODE_BITS 4
+#define SPARSE_NODE_SIZE (1 << SPARSE_NODE_BITS)
+#define SPARSE_NODE_MASK (SPARSE_NODE_SIZE - 1)
+#define SPARSE_NODE_BRICKS (SPARSE_NODE_SIZE * SPARSE_NODE_SIZE * SPARSE_NODE_SIZE)
+
+namespace scg
+{
+
+struct SparseNode
+{
+    uint64_t mask[SPARSE_NODE_BRICKS / 64]; // Bricks with voxels of their own
+    float min;                              // Range of the values that can be sampled inside
+    float max;
+};
+
+// VDB-like tree over the bricks of a sparse volume: a dense root grid of internal nodes, each holding the
+// offsets and value ranges of its bricks. Constant bricks are inactive and share their voxels, nodes with the
+// same constant everywhere share one tile node, so the tree grows with the occupied part of the volume only.
+class SparseTree
+{
+public:
+    int width = 0;  // Internal nodes along x
+    int height = 0; // Internal nodes along y
+    int depth = 0;  // Internal nodes along z
+
+    std::vector<uint32_t> root;    // Internal node of every root cell, z varying fastest
+    std::vector<SparseNode> nodes;
+    std::vector<uint32_t> bricks;  // Voxel offset of every brick, SPARSE_NODE_BRICKS per node, z varying fastest
+    std::vector<Macrocell> ranges; // Range of the values that can be sampled inside every brick, as bricks
+
+    // Largest opacity of every node and brick under the current transfer function
+    std::vector<float> nodeMajorants;
+    std::vector<float> brickMajorants;
+
+    // Index into bricks and ranges of the brick at bx, by, bz
+    inline size_t getBrick(int bx, int by, int bz) const
+    {
+        uint32_t node = root[((size_t)(bx >> SPARSE_NODE_BITS) * height + (by >> SPARSE_NODE_BITS)) * depth + (bz >> SPARSE_NODE_BITS)];
+
+        return (size_t)node * SPARSE_NODE_BRICKS +
+               (((bx & SPARSE_NODE_MASK) << SPARSE_NODE_BITS | (by & SPARSE_NODE_MASK)) << SPARSE_NODE_BITS | (bz & SPARSE_NODE_MASK));
+    }
+
+    size_t getMemoryUsage() const;
+
+    // Recomputes the majorants, called whenever the transfer function changes
+    void updateMajorants(TransferFunction const& transferFunction);
+};
+
+}
+
+#endif //RAYTRACER_SPARSETREE_H
@@ -9,6 +9,13 @@
 #include <algorithm>
 #include <vector>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Entries of the lookup table, spread uniformly over the intensities of the volume
+#define TRANSFER_TABLE_SIZE 4096
+
 namespace scg
 {
 
@@ -40,14 +47,45 @@ class TransferFunction
 private:
     std::vector<Node> nodes;
 
-public:
-    TransferFunction() = default;
+    // Colour and opacity baked at uniform intensities, rebuilt with every new transfer function
+    std::vector<Vec4f> table;
+    float tableMin = 0.0f;
+    float tableMax = 0.0f;
+    float tableScale = 0.0f; // Entries per unit of intensity
 
-    TransferFunction(std::vector<Node> const& nodes):
-        nodes(nodes) {};
+    // Integral of the opacity from the first entry to every entry, for pre-integrated segments
+    std::vector<double> integrals;
 
-    inline Vec4f evaluate(float intensity) const
+    // White isotropic phase function shared by all volume scattering, the colour of the sample goes into the throughput
+    std::shared_ptr<Material> phase;
+
+    // Integral of the opacity from the first entry to intensity, the opacity stays constant outside the table
+    inline double getIntegral(float intensity) const
     {
+        float clamped = clamp(intensity, tableMin, tableMax);
+        float position = (clamped - tableMin) * tableScale;
+        int index = std::min((int)position, TRANSFER_TABLE_SIZE - 2);
+        float weight = position - index;
+
+        float lower = table[index].w;
+        float upper = lerp(lower, table[index + 1].w, weight);
+        double integral = integrals[index] + 0.5 * (lower + upper) * weight / tableScale;
+
+        return integral + (double)(intensity - clamped) * (intensity < tableMin ? table.front().w : table.back().w);
+    }
+
+    // Interpolates between the nodes, intensities outside them take the closest node
+    inline Vec4f evaluateNodes(float intensity) const
+    {
+        if (intensity <= nodes.front().intensity)
+        {
+            return Vec4f(nodes.front().colour.x, nodes.front().colour.y, nodes.front().colour.z, nodes.front().opacity);
+        }
+        if (intensity >= nodes.back().intensity)
+        {
+            return Vec4f(nodes.back().colour.x, nodes.back().colour.y, nodes.back().colour.z, nodes.back().opacity);
+        }
+
         auto const& upper = std::upper_bound(nodes.begin(), nodes.end(), intensity);
         auto const& lower = upper - 1;
 
@@ -63,7 +101,126 @@ public:
         return out;
     }
 
-    inline std::shared_ptr<Material> getMaterial(float intensity, Sampler &sampler) const
+public:
+    TransferFunction() = default;
+
+    TransferFunction(std::vector<Node> const& nodes):
+        nodes(nodes),
+        phase(std::make_shared<Isotropic>(std::make_shared<ColourTexture>(Vec3f(1.0f, 1.0f, 1.0f))))
+    {
+        setRange(nodes.front().intensity, nodes.back().intensity);
+    };
+
+    // Bakes the table over [min, max], the intensities that can be sampled, intensities outside take the closest entry
+    // Nodes far past the values of the volume would otherwise leave few entries for its features
+    void setRange(float min, float max)
+    {
+        float range = std::max(max - min, 1.0f);
+        tableMin = min;
+        tableMax = min + range;
+        tableScale = (TRANSFER_TABLE_SIZE - 1) / range;
+
+        table.resize(TRANSFER_TABLE_SIZE);
+        for (int i = 0; i < TRANSFER_TABLE_SIZE; ++i)
+        {
+            table[i] = evaluateNodes(tableMin + range * i / (TRANSFER_TABLE_SIZE - 1));
+        }
+
+        // Trapezoids are exact, the opacity is linear between entries
+        integrals.resize(TRANSFER_TABLE_SIZE);
+        integrals[0] = 0.0;
+        for (int i = 1; i < TRANSFER_TABLE_SIZE; ++i)
+        {
+            integrals[i] = integrals[i - 1] + 0.5 * ((double)table[i - 1].w + table[i].w) * range / (TRANSFER_TABLE_SIZE - 1);
+        }
+    }
+
+    // Interpolates between the two closest entries of the table
+    inline Vec4f evaluate(float intensity) const
+    {
+        float position = clamp((intensity - tableMin) * tableScale, 0.0f, (float)(TRANSFER_TABLE_SIZE - 1));
+        int index = std::min((int)position, TRANSFER_TABLE_SIZE - 2);
+        float weight = position - index;
+
+        Vec4f const& lower = table[index];
+        Vec4f const& upper = table[index + 1];
+
+        return Vec4f(
+            lerp(lower.x, upper.x, weight),
+            lerp(lower.y, upper.y, weight),
+            lerp(lower.z, upper.z, weight),
+            lerp(lower.w, upper.w, weight));
+    }
+
+    // Opacities of count intensities, as evaluate
+    inline void evaluateOpacityN(float const* intensities, float *opacities, int count) const
+    {
+        int i = 0;
+
+#if defined(__AVX2__)
+        __m256 min = _mm256_set1_ps(tableMin);
+        __m256 scale = _mm256_set1_ps(tableScale);
+        __m256 last = _mm256_set1_ps((float)(TRANSFER_TABLE_SIZE - 1));
+        __m256i lastIndex = _mm256_set1_epi32(TRANSFER_TABLE_SIZE - 2);
+        float const* lower = &table[0].w;
+        float const* upper = &table[1].w;
+
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256 position = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(intensities + i), min), scale);
+            position = _mm256_min_ps(_mm256_max_ps(position, _mm256_setzero_ps()), last);
+
+            __m256i index = _mm256_min_epi32(_mm256_cvttps_epi32(position), lastIndex);
+            __m256 weight = _mm256_sub_ps(position, _mm256_cvtepi32_ps(index));
+
+            // Four floats per entry
+            __m256i offset = _mm256_slli_epi32(index, 2);
+            __m256 a = _mm256_i32gather_ps(lower, offset, 4);
+            __m256 b = _mm256_i32gather_ps(upper, offset, 4);
+
+            _mm256_storeu_ps(opacities + i, _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), weight)));
+        }
+#endif
+
+        for (; i < count; ++i)
+        {
+            opacities[i] = evaluate(intensities[i]).w;
+        }
+    }
+
+    // Mean opacity along a segment whose intensity varies linearly from front to back
+    inline float getMeanOpacity(float front, float back) const
+    {
+        // Within one entry the opacity is linear, the midpoint gives its mean without cancellation
+        if (std::floor((front - tableMin) * tableScale) == std::floor((back - tableMin) * tableScale))
+        {
+            return evaluate(0.5f * (front + back)).w;
+        }
+
+        return (float)((getIntegral(back) - getIntegral(front)) / (back - front));
+    }
+
+    inline Material const* getPhase() const
+    {
+        return phase.get();
+    }
+
+    // Largest opacity over the intensities in [min, max], opacity is linear between nodes
+    // The table at both ends is included, interpolating it near a node can exceed the nodes
+    inline float getMaxOpacity(float min, float max) const
+    {
+        float maxOpacity = std::max(std::max(evaluateNodes(min).w, evaluateNodes(max).w), std::max(evaluate(min).w, evaluate(max).w));
+
+        for (auto node = std::upper_bound(nodes.begin(), nodes.end(), min); node != nodes.end() && node->intensity < max; ++node)
+        {
+            maxOpacity = std::max(maxOpacity, node->opacity);
+        }
+
+        return maxOpacity;
+    }
+
+    // Not owning, the nodes keep their materials alive
+    inline Material const* getMaterial(float intensity, Sampler &sampler) const
     {
         auto const& upper = std::upper_bound(nodes.begin(), nodes.end(), intensity);
         auto const& lower = upper - 1;
@@ -73,11 +230,11 @@ public:
 
         if (sampler.nextFloat() < dist)
         {
-            return lower->material;
+            return lower->material.get();
         }
         else
         {
-            return upper->material;
+            return upper->material.get();
         }
     }
 };
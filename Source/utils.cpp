@@ -11,10 +11,23 @@
 
 #include "tinytiffreader.h"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
 #include <vector>
 
+// Part of every cache key, bump it when a loader changes the volumes it builds
+#define CACHE_VERSION 3
+
+// Consecutive slices decoded by one thread, z is the fastest axis of the linear layout so threads only share the
+// cache lines at the borders of their blocks (a 64 byte line holds 32 UInt16 voxels)
+#define SLICE_BLOCK 32
+
 namespace scg
 {
 
@@ -31,11 +44,19 @@ Settings loadSettings()
     settings.useBox = false;
 
     settings.octreeLevels = 5;
-    settings.brackets = std::vector<float>{
-        0, 1000, 1300, 1500, 1750, 1900, 2000, 2100, 2200, 2300, 2400, 2500, 2600, 2700, 2850, 3000, 3250, 3500, 99999 // 1 less than TF!
-    };
-    settings.maxOpacity.resize(settings.brackets.size() - 1);
-    settings.minStepSize.resize(settings.brackets.size() - 1);
+    settings.volumeLayout = VolumeLayout::Linear;
+    settings.sparseThreshold = 0.0f;
+    settings.voxelFormat = VoxelFormat::Float32;
+    settings.mipLevels = 2;
+    settings.shadowMipLevel = 0;
+    settings.bounceMipLevel = 1;
+    settings.bounceMipDepth = 2;
+    settings.useDistanceField = true;
+    settings.preIntegrate = true;
+    settings.useWavefront = false;
+    settings.usePackets = true;
+    settings.useCache = true;
+    settings.brickCacheSize = 512;
 
     return settings;
 }
@@ -124,6 +145,68 @@ void loadSettingsFile(Settings &settings)
 
             materials.emplace(name, material);
         }
+        else if (type == "layout")
+        {
+            std::string layout;
+            fin >> layout;
+
+            if (layout == "Bricked")
+                settings.volumeLayout = VolumeLayout::Bricked;
+            else if (layout == "Sparse")
+                settings.volumeLayout = VolumeLayout::Sparse;
+            else
+                settings.volumeLayout = VolumeLayout::Linear;
+        }
+        else if (type == "sparseThreshold")
+        {
+            fin >> settings.sparseThreshold;
+        }
+        else if (type == "format")
+        {
+            std::string format;
+            fin >> format;
+
+            if (format == "UInt16")
+                settings.voxelFormat = VoxelFormat::UInt16;
+            else if (format == "UInt8")
+                settings.voxelFormat = VoxelFormat::UInt8;
+            else if (format == "Float16")
+                settings.voxelFormat = VoxelFormat::Float16;
+            else
+                settings.voxelFormat = VoxelFormat::Float32;
+        }
+        else if (type == "mipLevels")
+        {
+            fin >> settings.mipLevels;
+        }
+        else if (type == "shadowMip")
+        {
+            fin >> settings.shadowMipLevel;
+        }
+        else if (type == "bounceMip")
+        {
+            fin >> settings.bounceMipDepth >> settings.bounceMipLevel;
+        }
+        else if (type == "distanceField")
+        {
+            fin >> settings.useDistanceField;
+        }
+        else if (type == "preIntegrate")
+        {
+            fin >> settings.preIntegrate;
+        }
+        else if (type == "wavefront")
+        {
+            fin >> settings.useWavefront;
+        }
+        else if (type == "packets")
+        {
+            fin >> settings.usePackets;
+        }
+        else if (type == "cache")
+        {
+            fin >> settings.useCache >> settings.brickCacheSize;
+        }
         else if (type == "box")
         {
             float size;
@@ -159,216 +242,338 @@ void loadSettingsFile(Settings &settings)
     }
 
     settings.transferFunction = scg::TransferFunction(nodes);
+}
 
-    for (int i = 0; i < (int)settings.minStepSize.size(); ++i)
+// Identifies a cached volume by its loader, sources and settings
+uint64_t getCacheKey(std::string const& loader, std::vector<std::string> const& sources, Settings const& settings)
+{
+    std::ostringstream description;
+    description << CACHE_VERSION << ' ' << loader << ' '
+                << settings.voxelFormat << ' ' << settings.volumeLayout << ' ' << settings.sparseThreshold << ' '
+                << settings.octreeLevels << ' ' << settings.mipLevels;
+
+    // Missing sources are part of the key as well
+    for (auto const& source : sources)
     {
-        settings.maxOpacity[i] = 0;
-        settings.minStepSize[i] = 0;
+        struct stat status;
+        description << ' ' << source;
+        if (stat(source.c_str(), &status) == 0)
+        {
+            description << ' ' << status.st_size << ' ' << status.st_mtime;
+        }
     }
 
-    settings.mask = 0;
-    for (size_t i = 0; i < nodes.size() - 1; ++i)
+    // FNV-1a
+    uint64_t key = 14695981039346656037ull;
+    for (char c : description.str())
     {
-        if (nodes[i].opacity > 0 || nodes[i + 1].opacity > 0)
-        {
-            for (int bracket = 0; bracket < (int)settings.brackets.size() - 1; ++bracket)
-            {
-                float minX = std::fmaxf(nodes[i].intensity, settings.brackets[bracket]);
-                float maxX = std::fminf(nodes[i + 1].intensity, settings.brackets[bracket + 1]);
+        key ^= (uint8_t)c;
+        key *= 1099511628211ull;
+    }
 
-                if (minX < maxX)
-                {
-                    settings.mask |= (1 << bracket);
+    return key;
+}
 
-                    float maxOpacity = std::fmaxf(settings.transferFunction.evaluate(minX).w, settings.transferFunction.evaluate(maxX).w);
-                    if (maxOpacity > settings.maxOpacity[bracket])
-                    {
-                        settings.maxOpacity[bracket] = maxOpacity;
-                    }
-                }
-            }
-        }
+// Every configuration has its own file, runs with other settings do not replace it
+std::string getCachePath(std::string const& name, uint64_t key)
+{
+    std::ostringstream path;
+    path << name << '.' << std::hex << key << ".cache";
+
+    return path.str();
+}
+
+bool loadCache(Scene &scene, Settings &settings, std::string const& name, uint64_t key)
+{
+    if (!settings.useCache)
+    {
+        return false;
+    }
+
+    std::string path = getCachePath(name, key);
+    std::shared_ptr<Volume> volume = Volume::map(path, key, (size_t)settings.brickCacheSize * 1024 * 1024);
+    if (!volume)
+    {
+        return false;
+    }
+
+    updateMajorants(*volume, settings.transferFunction);
+    scene.volume = volume;
+
+    std::cout << "Mapped " << path << std::endl;
+
+    return true;
+}
+
+void saveCache(Scene &scene, Settings &settings, std::string const& name, uint64_t key)
+{
+    if (!settings.useCache || !scene.volume)
+    {
+        return;
     }
 
-    for (int i = 0; i < (int)settings.minStepSize.size(); ++i)
+    std::string path = getCachePath(name, key);
+    if (!scene.volume->save(path, key))
     {
-        settings.minStepSize[i] =
-            1.0f * settings.maxOpacity[i] + 0.1f * (1 - settings.maxOpacity[i]);
+        std::cout << "ERROR writing " << path << std::endl;
+        return;
     }
+
+    // Render from the mapped copy, as later runs do
+    loadCache(scene, settings, name, key);
 }
 
-void loadBrain(scg::Volume& volume, scg::Volume& temp, Scene &scene, scg::Settings &settings)
+void loadBrain(Scene &scene, Settings &settings)
 {
+    int slices = 99;
+    float sliceSpacing = 1.3f;
+
+    scene.volumePos = Vec3f{-135, -141, -75};// scene.volumePos.x += 50.0f;
+
+    // Point lights
+    //scene.lights.emplace_back(std::make_shared<scg::PointLight>(scg::PointLight{{1.0f, 1.0f, 1.0f}, 20 * 80 * 80, {0, 0, 0}}));//Vec3f{0.0f, -0.75f, 0.0f} * 80}));
+    // Directional lights
+    scene.lights.emplace_back(std::make_shared<scg::DirectionalLight>(scg::DirectionalLight{{1.0f, 1.0f, 1.0f}, M_PI, {1.0f, 0.5f, 1.0f}}));
+
+    std::vector<std::string> sources;
     char filename[50] = "../data/StanfordBrain/mrbrain-16bit000.tif";
-    for (int x = 0; x < 99; ++x)
+    for (int z = 0; z < slices; ++z)
     {
-        sprintf(filename + 35, "%03d.tif", x + 1);
-        std::cout << "Loading: " << filename << std::endl;
+        sprintf(filename + 35, "%03d.tif", z + 1);
+        sources.emplace_back(filename);
+    }
 
-        TinyTIFFReaderFile* tiffr = TinyTIFFReader_open(filename);
-        if (!tiffr)
-        {
-            std::cout<<"ERROR reading (not existent, not accessible or no TIFF file)\n";
-        }
-        else
+    uint64_t key = getCacheKey("brain " + std::to_string(slices) + " " + std::to_string(sliceSpacing), sources, settings);
+    if (loadCache(scene, settings, "brain", key))
+    {
+        return;
+    }
+
+    std::shared_ptr<Volume> volume;
+
+    // The first readable slice gives the size of all of them
+    for (int z = 0; z < slices && !volume; ++z)
+    {
+        TinyTIFFReaderFile* tiffr = TinyTIFFReader_open(sources[z].c_str());
+        if (tiffr)
         {
             int width = TinyTIFFReader_getWidth(tiffr);
             int height = TinyTIFFReader_getHeight(tiffr);
-            uint16_t* image = (uint16_t*)calloc((size_t)width * height, sizeof(uint16_t));
-            TinyTIFFReader_getSampleData(tiffr, image, 0);
-
-            for (int y = 0; y < height; ++y)
-            {
-                for (int z = 0; z < width; ++z)
-                {
-                    temp.data[z][y][x] = image[y * width + z];
-                }
-            }
-
-            free(image);
+            volume = std::make_shared<Volume>(width, height, slices, VoxelFormat::UInt16, 0, 65535);
         }
         TinyTIFFReader_close(tiffr);
     }
-    
-    for (int x = 0; x < volume.width; ++x)
+
+    if (!volume)
+    {
+        std::cout<<"ERROR reading (not existent, not accessible or no TIFF file)\n";
+        return;
+    }
+
+    std::cout << "Loading: " << slices << " slices from ../data/StanfordBrain/" << std::endl;
+
+    // Blocks of slices are decoded in parallel, each thread reusing its own buffer
+    #pragma omp parallel
     {
-        for (int y = 0; y < volume.height; ++y)
+        std::vector<uint16_t> image((size_t)volume->width * volume->height);
+
+        #pragma omp for schedule(static, SLICE_BLOCK)
+        for (int z = 0; z < slices; ++z)
         {
-            for (int z = 0; z < volume.height; ++z)
+            TinyTIFFReaderFile* tiffr = TinyTIFFReader_open(sources[z].c_str());
+            if (!tiffr ||
+                (int)TinyTIFFReader_getWidth(tiffr) != volume->width ||
+                (int)TinyTIFFReader_getHeight(tiffr) != volume->height)
+            {
+                #pragma omp critical
+                std::cout << "ERROR reading " << sources[z] << std::endl;
+            }
+            else
             {
-                volume.data[z][y][x] = temp.sampleVolume(Vec3f(z, y, x / 1.3f));
+                TinyTIFFReader_getSampleData(tiffr, image.data(), 0);
+
+                for (int y = 0; y < volume->height; ++y)
+                {
+                    for (int x = 0; x < volume->width; ++x)
+                    {
+                        volume->setVoxel(x, y, z, image[y * volume->width + x]);
+                    }
+                }
             }
+            TinyTIFFReader_close(tiffr);
         }
     }
 
-    volume.octree.bb = BoundingBox(Vec3f(40 + V_EPS, 50 + V_EPS, 0 + V_EPS), Vec3f(230 - V_EPS, 220 - V_EPS, 135 - V_EPS));
-    buildOctree(volume, volume.octree, settings.octreeLevels, settings);
-
-    scene.volume = std::make_shared<Volume>(volume);
-    scene.volumePos = Vec3f{-135, -141, -75};// scene.volumePos.x += 50.0f;
+    // Slices are further apart than the pixels
+    volume->spacing = Vec3f(1.0f, 1.0f, sliceSpacing);
+    volume->octree.bb = intersect(
+        BoundingBox(Vec3f(40 + V_EPS, 50 + V_EPS, 0 + V_EPS), Vec3f(230 - V_EPS, 220 - V_EPS, 135 / sliceSpacing - V_EPS)),
+        volume->getBounds());
+    volume = convertVolume(volume, settings.voxelFormat);
+    volume->buildMips(settings.mipLevels);
+    volume->setLayout(settings.volumeLayout, settings.sparseThreshold);
+    buildOctrees(*volume, settings.octreeLevels);
+    buildMacrocells(*volume);
+    updateMajorants(*volume, settings.transferFunction);
+
+    scene.volume = volume;
+    saveCache(scene, settings, "brain", key);
 
     std::cout << "Done loadBrain." << std::endl;
-
-    // Point lights
-    //scene.lights.emplace_back(std::make_shared<scg::PointLight>(scg::PointLight{{1.0f, 1.0f, 1.0f}, 20 * 80 * 80, {0, 0, 0}}));//Vec3f{0.0f, -0.75f, 0.0f} * 80}));
-    // Directional lights
-    scene.lights.emplace_back(std::make_shared<scg::DirectionalLight>(scg::DirectionalLight{{1.0f, 1.0f, 1.0f}, M_PI, {1.0f, 0.5f, 1.0f}}));
 }
 
-void loadManix(Volume& volume, Volume& temp, Scene &scene, Settings &settings)
+void loadManix(Scene &scene, Settings &settings)
 {
-    std::ifstream fin;
-    fin.open("../data/Manix/manix.raw");
+    std::string source = "../data/Manix/manix.raw";
 
-    int width = 460;
+    int width = 512;
     int height = 512;
-    int depth = 512;
+    int slices = 460;
 
-    uint16_t val;
+    scene.volumePos = Vec3f{-135, -141, -75};
 
-    uint64_t sum = 0;
+    // Point lights
+    //scene.lights.emplace_back(std::make_shared<scg::PointLight>(scg::PointLight{{1.0f, 1.0f, 1.0f}, 20, {0.0f, -0.75f, 0.0f}}));
+    // Directional lights
+    scene.lights.emplace_back(std::make_shared<scg::DirectionalLight>(scg::DirectionalLight{{1.0f, 1.0f, 1.0f}, M_PI, {1.0f, 0.5f, 1.0f}}));
 
-    for (int x = 0; x < width; ++x)
+    std::string loader = "manix " + std::to_string(width) + " " + std::to_string(height) + " " + std::to_string(slices);
+    uint64_t key = getCacheKey(loader, {source}, settings);
+    if (loadCache(scene, settings, "manix", key))
     {
-        for (int y = 0; y < height; ++y)
-        {
-            for (int z = 0; z < depth; ++z)
-            {
-                fin.read((char*)&val, 2);
-                sum += val;
+        return;
+    }
 
-                if (val != *((int16_t*)&val)) std::cout << "WTF";
+    auto volume = std::make_shared<Volume>(width, height, slices, VoxelFormat::UInt16, 1000, 65535 + 1000);
 
-                temp.data[z][y][x] = val + 1000;
-            }
-        }
-    }
+    size_t sliceSize = (size_t)width * height;
+    uint64_t sum = 0;
 
-    std::cout << "Sum is: "  << sum << std::endl;
+    std::cout << "Loading: " << source << std::endl;
 
-    for (int x = 0; x < volume.width; ++x)
+    // Every thread reads blocks of whole slices through its own stream
+    #pragma omp parallel reduction(+:sum)
     {
-        for (int y = 0; y < volume.height; ++y)
+        std::ifstream fin(source, std::ios::binary);
+        std::vector<uint16_t> slice(sliceSize);
+
+        #pragma omp for schedule(static, SLICE_BLOCK)
+        for (int z = 0; z < slices; ++z)
         {
-            for (int z = 0; z < volume.height; ++z)
+            fin.seekg((std::streamoff)(z * sliceSize * sizeof(uint16_t)));
+            if (!fin.read((char*)slice.data(), (std::streamsize)(sliceSize * sizeof(uint16_t))))
+            {
+                std::fill(slice.begin(), slice.end(), 0);
+                fin.clear();
+            }
+
+            for (int y = 0; y < height; ++y)
             {
-                volume.data[z][y][x] = temp.sampleVolume(Vec3f(z, y, x));
+                for (int x = 0; x < width; ++x)
+                {
+                    uint16_t val = slice[y * width + x];
+                    sum += val;
+
+                    volume->setVoxel(x, y, z, val + 1000);
+                }
             }
         }
     }
 
-    volume.octree.bb = BoundingBox(Vec3f(0 + V_EPS, 0 + V_EPS, 0 + V_EPS), Vec3f(width - V_EPS, height - V_EPS, depth - V_EPS));
-    buildOctree(volume, volume.octree, settings.octreeLevels, settings);
+    std::cout << "Sum is: "  << sum << std::endl;
 
-    scene.volume = std::make_shared<Volume>(volume);
-    scene.volumePos = Vec3f{-135, -141, -75};
+    volume->octree.bb = intersect(
+        BoundingBox(Vec3f(0 + V_EPS, 0 + V_EPS, 0 + V_EPS), Vec3f(slices - V_EPS, height - V_EPS, width - V_EPS)),
+        volume->getBounds());
+    volume = convertVolume(volume, settings.voxelFormat);
+    volume->buildMips(settings.mipLevels);
+    volume->setLayout(settings.volumeLayout, settings.sparseThreshold);
+    buildOctrees(*volume, settings.octreeLevels);
+    buildMacrocells(*volume);
+    updateMajorants(*volume, settings.transferFunction);
+
+    scene.volume = volume;
+    saveCache(scene, settings, "manix", key);
 
     std::cout << "Done loadBrain." << std::endl;
+}
+
+void loadBunny(Scene &scene, Settings &settings)
+{
+    int width = 512;
+    int height = 512;
+    int slices = 360;
+    float sliceSpacing = 1.3f;
+
+    scene.volumePos = Vec3f{-255, -255, -255};
 
     // Point lights
-    //scene.lights.emplace_back(std::make_shared<scg::PointLight>(scg::PointLight{{1.0f, 1.0f, 1.0f}, 20, {0.0f, -0.75f, 0.0f}}));
+    //scene.lights.emplace_back(std::make_shared<scg::PointLight>(scg::PointLight{{1.0f, 1.0f, 1.0f}, 20 * 80 * 80, {0, 0, 0}}));//Vec3f{0.0f, -0.75f, 0.0f} * 80}));
     // Directional lights
     scene.lights.emplace_back(std::make_shared<scg::DirectionalLight>(scg::DirectionalLight{{1.0f, 1.0f, 1.0f}, M_PI, {1.0f, 0.5f, 1.0f}}));
-}
 
-void loadBunny(Volume& volume, Volume& temp, Scene &scene, Settings &settings)
-{
+    std::vector<std::string> sources;
     char filename[50] = "../data/StanfordBunny/";
+    for (int z = 0; z < slices; ++z)
+    {
+        sprintf(filename + 22, "%d", z + 1);
+        sources.emplace_back(filename);
+    }
 
-    std::ifstream fin;
+    std::string loader = "bunny " + std::to_string(width) + " " + std::to_string(height) + " " +
+                         std::to_string(slices) + " " + std::to_string(sliceSpacing);
+    uint64_t key = getCacheKey(loader, sources, settings);
+    if (loadCache(scene, settings, "bunny", key))
+    {
+        return;
+    }
 
-    int width = 360;
-    int height = 512;
-    int depth = 512;
+    auto volume = std::make_shared<Volume>(width, height, slices, VoxelFormat::UInt16, 1000, 65535 + 1000);
 
-    uint16_t val;
+    size_t sliceSize = (size_t)width * height;
 
-    for (int x = 0; x < width; ++x)
-    {
-        sprintf(filename + 22, "%d", x + 1);
-        std::cout << "Loading: " << filename << std::endl;
+    std::cout << "Loading: " << slices << " slices from ../data/StanfordBunny/" << std::endl;
 
-        fin.open(filename);
+    // Blocks of slices are read whole and decoded in parallel
+    #pragma omp parallel
+    {
+        std::vector<uint16_t> slice(sliceSize);
 
-        for (int y = 0; y < height; ++y)
+        #pragma omp for schedule(static, SLICE_BLOCK)
+        for (int z = 0; z < slices; ++z)
         {
-            for (int z = 0; z < depth; ++z)
+            std::ifstream fin(sources[z], std::ios::binary);
+            if (!fin.read((char*)slice.data(), (std::streamsize)(sliceSize * sizeof(uint16_t))))
             {
-                fin.read((char*)&val, 2);
-
-                temp.data[z][y][x] = val + 1000;
+                std::fill(slice.begin(), slice.end(), 0);
             }
-        }
-
-        fin.close();
-    }
 
-    for (int x = 0; x < volume.width; ++x)
-    {
-        for (int y = 0; y < volume.height; ++y)
-        {
-            for (int z = 0; z < volume.height; ++z)
+            for (int y = 0; y < height; ++y)
             {
-                volume.data[z][y][x] = temp.sampleVolume(Vec3f(z, y, x / 1.3f));
+                for (int x = 0; x < width; ++x)
+                {
+                    volume->setVoxel(x, y, z, slice[y * width + x] + 1000);
+                }
             }
         }
     }
 
-    volume.octree.bb = BoundingBox(Vec3f(0 + V_EPS, 0 + V_EPS, 0 + V_EPS), Vec3f(512 - V_EPS, 512 - V_EPS, 512 - V_EPS));
-    buildOctree(volume, volume.octree, settings.octreeLevels, settings);
+    // Slices are further apart than the pixels
+    volume->spacing = Vec3f(1.0f, 1.0f, sliceSpacing);
+    volume->octree.bb = volume->getBounds();
+    volume = convertVolume(volume, settings.voxelFormat);
+    volume->buildMips(settings.mipLevels);
+    volume->setLayout(settings.volumeLayout, settings.sparseThreshold);
+    buildOctrees(*volume, settings.octreeLevels);
+    buildMacrocells(*volume);
+    updateMajorants(*volume, settings.transferFunction);
 
-    scene.volume = std::make_shared<Volume>(volume);
-    scene.volumePos = Vec3f{-255, -255, -255};
+    scene.volume = volume;
+    saveCache(scene, settings, "bunny", key);
 
     std::cout << "Done loadBrain." << std::endl;
-
-    // Point lights
-    //scene.lights.emplace_back(std::make_shared<scg::PointLight>(scg::PointLight{{1.0f, 1.0f, 1.0f}, 20 * 80 * 80, {0, 0, 0}}));//Vec3f{0.0f, -0.75f, 0.0f} * 80}));
-    // Directional lights
-    scene.lights.emplace_back(std::make_shared<scg::DirectionalLight>(scg::DirectionalLight{{1.0f, 1.0f, 1.0f}, M_PI, {1.0f, 0.5f, 1.0f}}));
 }
 
-
 Scene loadTestModel(float size)
 {
     // Defines colours:
@@ -14,11 +14,14 @@ Settings loadSettings();
 
 void loadSettingsFile(Settings &settings);
 
-void loadBrain(Volume& volume, Volume& temp, Scene &scene, Settings &settings);
+// Dataset loaders, each creates the volume and hands it over to the scene
+// With settings.useCache the volume is mapped from <name>.<key>.cache, the key hashing the sources and settings
+// Each configuration keeps its own cache, stale ones are left for the user to delete
+void loadBrain(Scene &scene, Settings &settings);
 
-void loadManix(Volume& volume, Volume& temp, Scene &scene, Settings &settings);
+void loadManix(Scene &scene, Settings &settings);
 
-void loadBunny(Volume& volume, Volume& temp, Scene &scene, Settings &settings);
+void loadBunny(Scene &scene, Settings &settings);
 
 // Loads the Cornell Box. It is scaled to fill the volume:
 // -1 <= x <= +1
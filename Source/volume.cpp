@@ -3,103 +3,1564 @@
 #include "math_utils.h"
 #include "settings.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <utility>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 namespace scg
 {
 
-Volume::Volume(int height, int width, int depth):
-    height(height), width(width), depth(depth)
+size_t getVoxelSize(VoxelFormat format)
+{
+    switch (format)
+    {
+        case VoxelFormat::Float32:
+            return sizeof(float);
+        case VoxelFormat::UInt16:
+            return sizeof(uint16_t);
+        case VoxelFormat::UInt8:
+            return sizeof(uint8_t);
+        case VoxelFormat::Float16:
+            return sizeof(Half);
+    }
+
+    return 0;
+}
+
+Volume::Volume(int width, int height, int depth, VoxelFormat format, float minValue, float maxValue):
+    width(width), height(height), depth(depth), format(format),
+    data((size_t)width * height * depth * getVoxelSize(format) + VOXEL_PADDING, 0)
+{
+    this->strideX = (size_t)height * depth;
+    this->strideY = (size_t)depth;
+
+    if (format == VoxelFormat::UInt16 || format == VoxelFormat::UInt8)
+    {
+        float levels = format == VoxelFormat::UInt16 ? 65535.0f : 255.0f;
+
+        this->offset = minValue;
+        this->scale = maxValue > minValue ? (maxValue - minValue) / levels : 1.0f;
+    }
+
+    this->voxelData = data.data();
+    this->voxelBytes = data.size();
+    this->octree = Octree(getBounds());
+}
+
+void Volume::setVoxel(int x, int y, int z, float value)
 {
-    //this->data = new int[depth, height, width];
+    encode(&data[getIndex(x, y, z) * getVoxelSize(format)], value);
+}
 
-    this->octree = Octree(
-        BoundingBox(Vec3f(0 + V_EPS, 0 + V_EPS, 0 + V_EPS), Vec3f(230 - V_EPS, 220 - V_EPS, 135 - V_EPS))
-    );
+void Volume::encode(uint8_t* voxel, float value) const
+{
+    switch (format)
+    {
+        case VoxelFormat::Float32:
+            *reinterpret_cast<float*>(voxel) = value;
+            break;
+        case VoxelFormat::UInt16:
+            *reinterpret_cast<uint16_t*>(voxel) = (uint16_t)clamp(std::round((value - offset) / scale), 0.0f, 65535.0f);
+            break;
+        case VoxelFormat::UInt8:
+            *voxel = (uint8_t)clamp(std::round((value - offset) / scale), 0.0f, 255.0f);
+            break;
+        case VoxelFormat::Float16:
+            *reinterpret_cast<Half*>(voxel) = Half(value);
+            break;
+    }
 }
 
-void buildOctree(Volume const& volume, Octree &octree, int levels, Settings const& settings)
+Vec2f Volume::getRange() const
 {
-    BoundingBox &bb = octree.bb;
+    float minValue = INF;
+    float maxValue = -INF;
 
-    // Leaf
-    if (levels == 0)
+    #pragma omp parallel for schedule(static) reduction(min:minValue) reduction(max:maxValue)
+    for (int x = 0; x < width; ++x)
     {
-        octree.isLeaf = true;
+        for (int y = 0; y < height; ++y)
+        {
+            for (int z = 0; z < depth; ++z)
+            {
+                float value = getVoxel(x, y, z);
+                minValue = std::min(minValue, value);
+                maxValue = std::max(maxValue, value);
+            }
+        }
+    }
+
+    return Vec2f(minValue, maxValue);
+}
 
-        for (int x = (int)std::round(bb.min.x - 1); x <= (int)std::round(bb.max.x + 1); ++x)
+Vec2f Volume::getRange(int minX, int minY, int minZ, int maxX, int maxY, int maxZ) const
+{
+    float minValue = INF;
+    float maxValue = -INF;
+
+    for (int x = std::max(minX, 0); x <= std::min(maxX, width - 1); ++x)
+    {
+        for (int y = std::max(minY, 0); y <= std::min(maxY, height - 1); ++y)
         {
-            for (int y = (int)std::round(bb.min.y - 1); y <= (int)std::round(bb.max.y + 1); ++y)
+            for (int z = std::max(minZ, 0); z <= std::min(maxZ, depth - 1); ++z)
             {
-                for (int z = (int)std::round(bb.min.z - 1); z <= (int)std::round(bb.max.z + 1); ++z)
-                {
-                    int bracket = 0;
-                    float coef = volume.sampleVolume(Vec3f(x, y, z));
-                    while (settings.brackets[bracket + 1] <= coef)
-                        ++bracket;
+                float value = getVoxel(x, y, z);
+                minValue = std::min(minValue, value);
+                maxValue = std::max(maxValue, value);
+            }
+        }
+    }
+
+    return Vec2f(minValue, maxValue);
+}
+
+size_t Volume::getMemoryUsage() const
+{
+    size_t memory = data.size() + bricks.size() * sizeof(uint32_t) + tree.getMemoryUsage();
+
+    // Only the resident part of a mapped volume, all of it if it is not cached
+    if (cache)
+    {
+        memory += cache->getResidentBricks() * BRICK_VOXELS * getVoxelSize(format);
+    }
+    else if (data.empty())
+    {
+        memory += voxelBytes;
+    }
+
+    for (auto const& mip : mips)
+    {
+        memory += mip->getMemoryUsage();
+    }
+
+    return memory;
+}
+
+void Volume::sampleVolumeN(Vec3f const* positions, float* values, int count) const
+{
+    // Gathers take 32 bit offsets
+    if (voxelBytes > (size_t)INT32_MAX)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            values[i] = sampleVolume(positions[i]);
+        }
+
+        return;
+    }
+
+    alignas(32) float x[SIMD_WIDTH];
+    alignas(32) float y[SIMD_WIDTH];
+    alignas(32) float z[SIMD_WIDTH];
+    alignas(32) float batch[SIMD_WIDTH];
+
+    for (int i = 0; i < count; i += SIMD_WIDTH)
+    {
+        int n = std::min(SIMD_WIDTH, count - i);
+
+        // Repeat the last position to fill the batch
+        for (int k = 0; k < SIMD_WIDTH; ++k)
+        {
+            Vec3f const& pos = positions[i + std::min(k, n - 1)];
+            x[k] = pos.x;
+            y[k] = pos.y;
+            z[k] = pos.z;
+        }
+
+        sampleBatch(x, y, z, batch);
+
+        for (int k = 0; k < n; ++k)
+        {
+            values[i + k] = batch[k];
+        }
+    }
+}
+
+void Volume::sampleVolumeN(float const* x, float const* y, float const* z, float* values, int count) const
+{
+    // Gathers take 32 bit offsets
+    if (voxelBytes > (size_t)INT32_MAX)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            values[i] = sampleVolume(Vec3f(x[i], y[i], z[i]));
+        }
+
+        return;
+    }
+
+    int full = count - count % SIMD_WIDTH;
+    for (int i = 0; i < full; i += SIMD_WIDTH)
+    {
+        sampleBatch(x + i, y + i, z + i, values + i);
+    }
+
+    if (full == count)
+    {
+        return;
+    }
+
+    alignas(32) float tailX[SIMD_WIDTH];
+    alignas(32) float tailY[SIMD_WIDTH];
+    alignas(32) float tailZ[SIMD_WIDTH];
+    alignas(32) float batch[SIMD_WIDTH];
+
+    // Repeat the last position to fill the batch
+    for (int k = 0; k < SIMD_WIDTH; ++k)
+    {
+        int i = std::min(full + k, count - 1);
+        tailX[k] = x[i];
+        tailY[k] = y[i];
+        tailZ[k] = z[i];
+    }
+
+    sampleBatch(tailX, tailY, tailZ, batch);
+
+    for (int i = full; i < count; ++i)
+    {
+        values[i] = batch[i - full];
+    }
+}
+
+#if defined(__AVX2__)
+
+template<typename T>
+inline __m256 gatherVoxels(uint8_t const* voxels, __m256i index);
+
+template<>
+inline __m256 gatherVoxels<float>(uint8_t const* voxels, __m256i index)
+{
+    return _mm256_i32gather_ps(reinterpret_cast<float const*>(voxels), index, 4);
+}
+
+// Narrow formats gather a 32 bit word at each voxel and keep the low bits
+template<>
+inline __m256 gatherVoxels<uint16_t>(uint8_t const* voxels, __m256i index)
+{
+    __m256i words = _mm256_i32gather_epi32(reinterpret_cast<int const*>(voxels), index, 2);
+    return _mm256_cvtepi32_ps(_mm256_and_si256(words, _mm256_set1_epi32(0xffff)));
+}
+
+template<>
+inline __m256 gatherVoxels<uint8_t>(uint8_t const* voxels, __m256i index)
+{
+    __m256i words = _mm256_i32gather_epi32(reinterpret_cast<int const*>(voxels), index, 1);
+    return _mm256_cvtepi32_ps(_mm256_and_si256(words, _mm256_set1_epi32(0xff)));
+}
+
+#if defined(__F16C__)
+template<>
+inline __m256 gatherVoxels<Half>(uint8_t const* voxels, __m256i index)
+{
+    __m256i words = _mm256_i32gather_epi32(reinterpret_cast<int const*>(voxels), index, 2);
+    words = _mm256_and_si256(words, _mm256_set1_epi32(0xffff));
+    __m128i halves = _mm_packus_epi32(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+    return _mm256_cvtph_ps(halves);
+}
+#endif
+
+inline __m256 lerp8(__m256 value1, __m256 value2, __m256 weight)
+{
+    __m256 one = _mm256_set1_ps(1.0f);
+    return _mm256_add_ps(_mm256_mul_ps(value1, _mm256_sub_ps(one, weight)), _mm256_mul_ps(value2, weight));
+}
+
+template<typename T>
+inline __m256 trilinear8(uint8_t const* voxels, __m256i index, __m256i strideX, __m256i strideY,
+                         __m256 dx, __m256 dy, __m256 dz)
+{
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i indexY = _mm256_add_epi32(index, strideY);
+    __m256i indexX = _mm256_add_epi32(index, strideX);
+    __m256i indexXY = _mm256_add_epi32(indexX, strideY);
+
+    __m256 c000 = gatherVoxels<T>(voxels, index);
+    __m256 c001 = gatherVoxels<T>(voxels, _mm256_add_epi32(index, one));
+    __m256 c010 = gatherVoxels<T>(voxels, indexY);
+    __m256 c011 = gatherVoxels<T>(voxels, _mm256_add_epi32(indexY, one));
+    __m256 c100 = gatherVoxels<T>(voxels, indexX);
+    __m256 c101 = gatherVoxels<T>(voxels, _mm256_add_epi32(indexX, one));
+    __m256 c110 = gatherVoxels<T>(voxels, indexXY);
+    __m256 c111 = gatherVoxels<T>(voxels, _mm256_add_epi32(indexXY, one));
+
+    __m256 c00 = lerp8(c000, c100, dx);
+    __m256 c01 = lerp8(c001, c101, dx);
+    __m256 c10 = lerp8(c010, c110, dx);
+    __m256 c11 = lerp8(c011, c111, dx);
+
+    __m256 c0 = lerp8(c00, c10, dy);
+    __m256 c1 = lerp8(c01, c11, dy);
+
+    return lerp8(c0, c1, dz);
+}
+
+void Volume::sampleBatch(float const* x, float const* y, float const* z, float* values) const
+{
+#if !defined(__F16C__)
+    if (format == VoxelFormat::Float16)
+    {
+        for (int k = 0; k < SIMD_WIDTH; ++k)
+        {
+            values[k] = sampleVolume(Vec3f(x[k], y[k], z[k]));
+        }
+
+        return;
+    }
+#endif
+
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 fx = _mm256_sub_ps(_mm256_load_ps(x), half);
+    __m256 fy = _mm256_sub_ps(_mm256_load_ps(y), half);
+    __m256 fz = _mm256_sub_ps(_mm256_load_ps(z), half);
+
+    __m256i px = _mm256_cvttps_epi32(fx);
+    __m256i py = _mm256_cvttps_epi32(fy);
+    __m256i pz = _mm256_cvttps_epi32(fz);
+
+    __m256 dx = _mm256_sub_ps(fx, _mm256_cvtepi32_ps(px));
+    __m256 dy = _mm256_sub_ps(fy, _mm256_cvtepi32_ps(py));
+    __m256 dz = _mm256_sub_ps(fz, _mm256_cvtepi32_ps(pz));
 
-                    octree.mask |= (1 << bracket);
+    __m256i strideX = _mm256_set1_epi32((int)this->strideX);
+    __m256i strideY = _mm256_set1_epi32((int)this->strideY);
+
+    __m256i index;
+    if (layout == VolumeLayout::Linear)
+    {
+        index = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(px, strideX), _mm256_mullo_epi32(py, strideY)), pz);
+    }
+    else
+    {
+        __m256i brick;
+        if (layout == VolumeLayout::Sparse)
+        {
+            // Node of the root grid, then brick of the node
+            __m256i nodeIndex = _mm256_add_epi32(
+                _mm256_mullo_epi32(
+                    _mm256_add_epi32(
+                        _mm256_mullo_epi32(_mm256_srli_epi32(px, BRICK_BITS + SPARSE_NODE_BITS), _mm256_set1_epi32(tree.height)),
+                        _mm256_srli_epi32(py, BRICK_BITS + SPARSE_NODE_BITS)),
+                    _mm256_set1_epi32(tree.depth)),
+                _mm256_srli_epi32(pz, BRICK_BITS + SPARSE_NODE_BITS));
+            __m256i node = _mm256_i32gather_epi32(reinterpret_cast<int const*>(tree.root.data()), nodeIndex, 4);
+
+            __m256i nodeMask = _mm256_set1_epi32(SPARSE_NODE_MASK);
+            __m256i local = _mm256_or_si256(
+                _mm256_slli_epi32(
+                    _mm256_or_si256(
+                        _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(px, BRICK_BITS), nodeMask), SPARSE_NODE_BITS),
+                        _mm256_and_si256(_mm256_srli_epi32(py, BRICK_BITS), nodeMask)),
+                    SPARSE_NODE_BITS),
+                _mm256_and_si256(_mm256_srli_epi32(pz, BRICK_BITS), nodeMask));
+            __m256i brickIndex = _mm256_add_epi32(_mm256_slli_epi32(node, 3 * SPARSE_NODE_BITS), local);
+            brick = _mm256_i32gather_epi32(reinterpret_cast<int const*>(tree.bricks.data()), brickIndex, 4);
+        }
+        else
+        {
+            __m256i brickIndex = _mm256_add_epi32(
+                _mm256_mullo_epi32(
+                    _mm256_add_epi32(
+                        _mm256_mullo_epi32(_mm256_srli_epi32(px, BRICK_BITS), _mm256_set1_epi32(bricksY)),
+                        _mm256_srli_epi32(py, BRICK_BITS)),
+                    _mm256_set1_epi32(bricksZ)),
+                _mm256_srli_epi32(pz, BRICK_BITS));
+            brick = _mm256_i32gather_epi32(reinterpret_cast<int const*>(bricks.data()), brickIndex, 4);
+        }
+
+        __m256i mask = _mm256_set1_epi32(BRICK_MASK);
+        index = _mm256_add_epi32(
+            _mm256_add_epi32(brick, _mm256_mullo_epi32(_mm256_and_si256(px, mask), strideX)),
+            _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(py, mask), strideY), _mm256_and_si256(pz, mask)));
+    }
+
+    __m256 result = _mm256_setzero_ps();
+    switch (format)
+    {
+        case VoxelFormat::Float32:
+            result = trilinear8<float>(voxelData, index, strideX, strideY, dx, dy, dz);
+            break;
+        case VoxelFormat::UInt16:
+            result = trilinear8<uint16_t>(voxelData, index, strideX, strideY, dx, dy, dz);
+            result = _mm256_add_ps(_mm256_mul_ps(result, _mm256_set1_ps(scale)), _mm256_set1_ps(offset));
+            break;
+        case VoxelFormat::UInt8:
+            result = trilinear8<uint8_t>(voxelData, index, strideX, strideY, dx, dy, dz);
+            result = _mm256_add_ps(_mm256_mul_ps(result, _mm256_set1_ps(scale)), _mm256_set1_ps(offset));
+            break;
+        default:
+#if defined(__F16C__)
+            result = trilinear8<Half>(voxelData, index, strideX, strideY, dx, dy, dz);
+#endif
+            break;
+    }
+
+    _mm256_store_ps(values, result);
+}
+
+#elif defined(__SSE2__)
+
+inline __m128 lerp4(__m128 value1, __m128 value2, __m128 weight)
+{
+    __m128 one = _mm_set1_ps(1.0f);
+    return _mm_add_ps(_mm_mul_ps(value1, _mm_sub_ps(one, weight)), _mm_mul_ps(value2, weight));
+}
+
+// Fetches the 8 corners of every lane, corners[corner][lane]
+template<typename T>
+inline void fetchCorners(T const* voxels, size_t const* index, size_t strideX, size_t strideY, float corners[8][4])
+{
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        T const* corner = voxels + index[lane];
+
+        corners[0][lane] = corner[0];
+        corners[1][lane] = corner[1];
+        corners[2][lane] = corner[strideY];
+        corners[3][lane] = corner[strideY + 1];
+        corners[4][lane] = corner[strideX];
+        corners[5][lane] = corner[strideX + 1];
+        corners[6][lane] = corner[strideX + strideY];
+        corners[7][lane] = corner[strideX + strideY + 1];
+    }
+}
+
+// No gathers: addresses and loads are scalar, interpolation is vectorised
+void Volume::sampleBatch(float const* x, float const* y, float const* z, float* values) const
+{
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 fx = _mm_sub_ps(_mm_load_ps(x), half);
+    __m128 fy = _mm_sub_ps(_mm_load_ps(y), half);
+    __m128 fz = _mm_sub_ps(_mm_load_ps(z), half);
+
+    __m128i px = _mm_cvttps_epi32(fx);
+    __m128i py = _mm_cvttps_epi32(fy);
+    __m128i pz = _mm_cvttps_epi32(fz);
+
+    __m128 dx = _mm_sub_ps(fx, _mm_cvtepi32_ps(px));
+    __m128 dy = _mm_sub_ps(fy, _mm_cvtepi32_ps(py));
+    __m128 dz = _mm_sub_ps(fz, _mm_cvtepi32_ps(pz));
+
+    alignas(16) int32_t ix[4];
+    alignas(16) int32_t iy[4];
+    alignas(16) int32_t iz[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(ix), px);
+    _mm_store_si128(reinterpret_cast<__m128i*>(iy), py);
+    _mm_store_si128(reinterpret_cast<__m128i*>(iz), pz);
+
+    size_t index[4];
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        index[lane] = getIndex(ix[lane], iy[lane], iz[lane]);
+    }
+
+    alignas(16) float corners[8][4];
+    switch (format)
+    {
+        case VoxelFormat::Float32:
+            fetchCorners(voxels<float>(), index, strideX, strideY, corners);
+            break;
+        case VoxelFormat::UInt16:
+            fetchCorners(voxels<uint16_t>(), index, strideX, strideY, corners);
+            break;
+        case VoxelFormat::UInt8:
+            fetchCorners(voxels<uint8_t>(), index, strideX, strideY, corners);
+            break;
+        case VoxelFormat::Float16:
+            fetchCorners(voxels<Half>(), index, strideX, strideY, corners);
+            break;
+    }
+
+    __m128 c00 = lerp4(_mm_load_ps(corners[0]), _mm_load_ps(corners[4]), dx);
+    __m128 c01 = lerp4(_mm_load_ps(corners[1]), _mm_load_ps(corners[5]), dx);
+    __m128 c10 = lerp4(_mm_load_ps(corners[2]), _mm_load_ps(corners[6]), dx);
+    __m128 c11 = lerp4(_mm_load_ps(corners[3]), _mm_load_ps(corners[7]), dx);
+
+    __m128 c0 = lerp4(c00, c10, dy);
+    __m128 c1 = lerp4(c01, c11, dy);
+
+    __m128 result = lerp4(c0, c1, dz);
+
+    if (format == VoxelFormat::UInt16 || format == VoxelFormat::UInt8)
+    {
+        result = _mm_add_ps(_mm_mul_ps(result, _mm_set1_ps(scale)), _mm_set1_ps(offset));
+    }
+
+    _mm_store_ps(values, result);
+}
+
+#else
+
+void Volume::sampleBatch(float const* x, float const* y, float const* z, float* values) const
+{
+    values[0] = sampleVolume(Vec3f(x[0], y[0], z[0]));
+}
+
+#endif
+
+template<typename T>
+void Volume::loadNeighbourhood(int x, int y, int z, float neighbourhood[4][4][4]) const
+{
+    T const* voxels = this->voxels<T>();
+
+    // The whole neighbourhood is inside one brick (apron included), so it can be read with the brick strides
+    bool contiguous = layout == VolumeLayout::Linear ||
+                      ((x & BRICK_MASK) <= BRICK_SIZE - 3 &&
+                       (y & BRICK_MASK) <= BRICK_SIZE - 3 &&
+                       (z & BRICK_MASK) <= BRICK_SIZE - 3);
+
+    if (contiguous)
+    {
+        T const* corner = voxels + getIndex(x, y, z);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                T const* row = corner + i * strideX + j * strideY;
+
+                for (int k = 0; k < 4; ++k)
+                {
+                    neighbourhood[i][j][k] = row[k];
+                }
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                for (int k = 0; k < 4; ++k)
+                {
+                    neighbourhood[i][j][k] = voxels[getIndex(x + i, y + j, z + k)];
                 }
             }
         }
+    }
+}
+
+// Trilinear interpolation inside a 4^3 neighbourhood, the position is relative to its first voxel centre
+inline float interpolate(float const neighbourhood[4][4][4], float x, float y, float z)
+{
+    int px = std::min((int)x, 2);
+    int py = std::min((int)y, 2);
+    int pz = std::min((int)z, 2);
+
+    float dx = x - px;
+    float dy = y - py;
+    float dz = z - pz;
+
+    float c00 = lerp(neighbourhood[px][py][pz],         neighbourhood[px + 1][py][pz],         dx);
+    float c01 = lerp(neighbourhood[px][py][pz + 1],     neighbourhood[px + 1][py][pz + 1],     dx);
+    float c10 = lerp(neighbourhood[px][py + 1][pz],     neighbourhood[px + 1][py + 1][pz],     dx);
+    float c11 = lerp(neighbourhood[px][py + 1][pz + 1], neighbourhood[px + 1][py + 1][pz + 1], dx);
+
+    float c0 = lerp(c00, c10, dy);
+    float c1 = lerp(c01, c11, dy);
+
+    return lerp(c0, c1, dz);
+}
+
+float Volume::sampleVolumeGradient(Vec3f const& pos, float eps, Vec3f& gradient) const
+{
+    int px = (int)(pos.x - 0.5f);
+    int py = (int)(pos.y - 0.5f);
+    int pz = (int)(pos.z - 0.5f);
+
+    // Position inside the neighbourhood starting one voxel before the sample cell
+    float x = pos.x - px + 0.5f;
+    float y = pos.y - py + 0.5f;
+    float z = pos.z - pz + 0.5f;
 
+    float neighbourhood[4][4][4];
+
+    switch (format)
+    {
+        case VoxelFormat::Float32:
+            loadNeighbourhood<float>(px - 1, py - 1, pz - 1, neighbourhood);
+            break;
+        case VoxelFormat::UInt16:
+            loadNeighbourhood<uint16_t>(px - 1, py - 1, pz - 1, neighbourhood);
+            break;
+        case VoxelFormat::UInt8:
+            loadNeighbourhood<uint8_t>(px - 1, py - 1, pz - 1, neighbourhood);
+            break;
+        case VoxelFormat::Float16:
+            loadNeighbourhood<Half>(px - 1, py - 1, pz - 1, neighbourhood);
+            break;
+    }
+
+    gradient = Vec3f(
+        interpolate(neighbourhood, x - eps, y, z) - interpolate(neighbourhood, x + eps, y, z),
+        interpolate(neighbourhood, x, y - eps, z) - interpolate(neighbourhood, x, y + eps, z),
+        interpolate(neighbourhood, x, y, z - eps) - interpolate(neighbourhood, x, y, z + eps)) * scale;
+
+    return interpolate(neighbourhood, x, y, z) * scale + offset;
+}
+
+void Volume::setLayout(VolumeLayout layout, float threshold)
+{
+    for (auto& mip : mips)
+    {
+        mip->setLayout(layout, threshold);
+    }
+
+    if (layout == this->layout || this->layout != VolumeLayout::Linear)
+    {
         return;
     }
 
-    octree.isLeaf = false;
-
-    // Create 8 child nodes
-    // 000
-    octree.nodes[0] = new Octree(
-        BoundingBox(Vec3f(bb.min.x, bb.min.y, bb.min.z), Vec3f(bb.mid.x, bb.mid.y, bb.mid.z))
-    );
-    buildOctree(volume, *octree.nodes[0], levels - 1, settings);
-    // 001
-    octree.nodes[1] = new Octree(
-        BoundingBox(Vec3f(bb.min.x, bb.min.y, bb.mid.z), Vec3f(bb.mid.x, bb.mid.y, bb.max.z))
-    );
-    buildOctree(volume, *octree.nodes[1], levels - 1, settings);
-    // 010
-    octree.nodes[2] = new Octree(
-        BoundingBox(Vec3f(bb.min.x, bb.mid.y, bb.min.z), Vec3f(bb.mid.x, bb.max.y, bb.mid.z))
-    );
-    buildOctree(volume, *octree.nodes[2], levels - 1, settings);
-    // 011
-    octree.nodes[3] = new Octree(
-        BoundingBox(Vec3f(bb.min.x, bb.mid.y, bb.mid.z), Vec3f(bb.mid.x, bb.max.y, bb.max.z))
-    );
-    buildOctree(volume, *octree.nodes[3], levels - 1, settings);
-    // 100
-    octree.nodes[4] = new Octree(
-        BoundingBox(Vec3f(bb.mid.x, bb.min.y, bb.min.z), Vec3f(bb.max.x, bb.mid.y, bb.mid.z))
-    );
-    buildOctree(volume, *octree.nodes[4], levels - 1, settings);
-    // 101
-    octree.nodes[5] = new Octree(
-        BoundingBox(Vec3f(bb.mid.x, bb.min.y, bb.mid.z), Vec3f(bb.max.x, bb.mid.y, bb.max.z))
-    );
-    buildOctree(volume, *octree.nodes[5], levels - 1, settings);
-    // 110
-    octree.nodes[6] = new Octree(
-        BoundingBox(Vec3f(bb.mid.x, bb.mid.y, bb.min.z), Vec3f(bb.max.x, bb.max.y, bb.mid.z))
-    );
-    buildOctree(volume, *octree.nodes[6], levels - 1, settings);
-    // 111
-    octree.nodes[7] = new Octree(
-        BoundingBox(Vec3f(bb.mid.x, bb.mid.y, bb.mid.z), Vec3f(bb.max.x, bb.max.y, bb.max.z))
-    );
-    buildOctree(volume, *octree.nodes[7], levels - 1, settings);
-
-    int maskAll = octree.nodes[0]->mask;
-    for (int i = 0; i < 8; ++i)
-    {
-        octree.mask |= octree.nodes[i]->mask;
-        maskAll &= octree.nodes[i]->mask;
-    }
-
-    if (octree.mask == maskAll)
-    {
-        // TODO: free memory!
-        octree.isLeaf = true;
-    }
-}
-
-}
\ No newline at end of file
+    int bricksX = (width + BRICK_SIZE - 1) >> BRICK_BITS;
+    int bricksY = (height + BRICK_SIZE - 1) >> BRICK_BITS;
+    int bricksZ = (depth + BRICK_SIZE - 1) >> BRICK_BITS;
+    size_t brickCount = (size_t)bricksX * bricksY * bricksZ;
+    size_t voxelSize = getVoxelSize(format);
+
+    // Calls f(x, y, z) for every voxel of a brick, including the apron, clamped to the edge of the volume
+    auto forEachVoxel = [&](int bx, int by, int bz, auto &&f)
+    {
+        for (int x = 0; x < BRICK_SIDE; ++x)
+        {
+            int vx = std::min((bx << BRICK_BITS) + x, width - 1);
+            for (int y = 0; y < BRICK_SIDE; ++y)
+            {
+                int vy = std::min((by << BRICK_BITS) + y, height - 1);
+                for (int z = 0; z < BRICK_SIDE; ++z)
+                {
+                    int vz = std::min((bz << BRICK_BITS) + z, depth - 1);
+                    f(vx, vy, vz);
+                }
+            }
+        }
+    };
+
+    // Place the bricks along a Z-order curve so neighbours in any direction stay close in memory
+    std::vector<std::pair<uint64_t, uint32_t>> order;
+    order.reserve(brickCount);
+    for (int bx = 0; bx < bricksX; ++bx)
+    {
+        for (int by = 0; by < bricksY; ++by)
+        {
+            for (int bz = 0; bz < bricksZ; ++bz)
+            {
+                uint32_t index = (uint32_t)((bx * bricksY + by) * bricksZ + bz);
+                order.emplace_back(mortonEncode(bx, by, bz), index);
+            }
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    // Sparse: empty bricks, at or below the threshold, all take the average of their voxels. It is written to the
+    // voxels themselves, so the aprons of their neighbours hold it as well and the field stays continuous across bricks.
+    // Bricks left uniform, apron included, are then replaced by a single shared brick per value.
+    std::vector<bool> isConstant(brickCount, false);
+    std::vector<float> constant(brickCount, 0.0f);
+    if (layout == VolumeLayout::Sparse)
+    {
+        std::vector<bool> isEmpty(brickCount, false);
+        double emptySum = 0.0;
+        size_t emptyCount = 0;
+
+        for (int bx = 0; bx < bricksX; ++bx)
+        {
+            for (int by = 0; by < bricksY; ++by)
+            {
+                for (int bz = 0; bz < bricksZ; ++bz)
+                {
+                    float maxValue = -INF;
+                    double sum = 0.0;
+                    forEachVoxel(bx, by, bz, [&](int x, int y, int z)
+                    {
+                        float value = getVoxel(x, y, z);
+                        maxValue = std::max(maxValue, value);
+                        sum += value;
+                    });
+
+                    if (maxValue <= threshold)
+                    {
+                        isEmpty[((size_t)bx * bricksY + by) * bricksZ + bz] = true;
+                        emptySum += sum;
+                        emptyCount += BRICK_VOXELS;
+                    }
+                }
+            }
+        }
+
+        float empty = emptyCount > 0 ? (float)(emptySum / emptyCount) : 0.0f;
+
+        // Only the voxels of the brick itself, the apron belongs to the next brick
+        for (int bx = 0; bx < bricksX; ++bx)
+        {
+            for (int by = 0; by < bricksY; ++by)
+            {
+                for (int bz = 0; bz < bricksZ; ++bz)
+                {
+                    if (!isEmpty[((size_t)bx * bricksY + by) * bricksZ + bz])
+                    {
+                        continue;
+                    }
+
+                    for (int x = bx << BRICK_BITS; x < std::min((bx + 1) << BRICK_BITS, width); ++x)
+                    {
+                        for (int y = by << BRICK_BITS; y < std::min((by + 1) << BRICK_BITS, height); ++y)
+                        {
+                            for (int z = bz << BRICK_BITS; z < std::min((bz + 1) << BRICK_BITS, depth); ++z)
+                            {
+                                setVoxel(x, y, z, empty);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        for (int bx = 0; bx < bricksX; ++bx)
+        {
+            for (int by = 0; by < bricksY; ++by)
+            {
+                for (int bz = 0; bz < bricksZ; ++bz)
+                {
+                    float minValue = INF;
+                    float maxValue = -INF;
+                    forEachVoxel(bx, by, bz, [&](int x, int y, int z)
+                    {
+                        float value = getVoxel(x, y, z);
+                        minValue = std::min(minValue, value);
+                        maxValue = std::max(maxValue, value);
+                    });
+
+                    size_t index = ((size_t)bx * bricksY + by) * bricksZ + bz;
+                    if (minValue == maxValue)
+                    {
+                        isConstant[index] = true;
+                        constant[index] = minValue;
+                    }
+                }
+            }
+        }
+    }
+
+    // Assign storage in Z-order, constant bricks of the same value share one
+    std::vector<uint32_t> bricks(brickCount);
+    std::map<float, uint32_t> constantBricks;
+    uint32_t stored = 0;
+    for (auto const& brick : order)
+    {
+        uint32_t index = brick.second;
+
+        if (isConstant[index])
+        {
+            auto shared = constantBricks.find(constant[index]);
+            if (shared != constantBricks.end())
+            {
+                bricks[index] = shared->second;
+                continue;
+            }
+
+            constantBricks.emplace(constant[index], stored * BRICK_VOXELS);
+        }
+
+        bricks[index] = stored * BRICK_VOXELS;
+        ++stored;
+    }
+
+    // Copy the voxels
+    std::vector<uint8_t> bricked((size_t)stored * BRICK_VOXELS * voxelSize + VOXEL_PADDING);
+    for (int bx = 0; bx < bricksX; ++bx)
+    {
+        for (int by = 0; by < bricksY; ++by)
+        {
+            for (int bz = 0; bz < bricksZ; ++bz)
+            {
+                size_t index = ((size_t)bx * bricksY + by) * bricksZ + bz;
+                uint8_t* brick = &bricked[bricks[index] * voxelSize];
+
+                if (isConstant[index])
+                {
+                    for (int i = 0; i < BRICK_VOXELS; ++i)
+                    {
+                        encode(brick + i * voxelSize, constant[index]);
+                    }
+                    continue;
+                }
+
+                forEachVoxel(bx, by, bz, [&](int x, int y, int z)
+                {
+                    std::memcpy(brick, &data[getIndex(x, y, z) * voxelSize], voxelSize);
+                    brick += voxelSize;
+                });
+            }
+        }
+    }
+
+    this->layout = layout;
+    this->data = std::move(bricked);
+    this->voxelData = data.data();
+    this->voxelBytes = data.size();
+    this->bricksX = bricksX;
+    this->bricksY = bricksY;
+    this->bricksZ = bricksZ;
+    this->strideX = BRICK_SIDE * BRICK_SIDE;
+    this->strideY = BRICK_SIDE;
+
+    if (layout == VolumeLayout::Sparse)
+    {
+        buildTree(bricks, isConstant);
+    }
+    else
+    {
+        this->bricks = std::move(bricks);
+    }
+}
+
+void Volume::buildTree(std::vector<uint32_t> const& bricks, std::vector<bool> const& isConstant)
+{
+    tree = SparseTree();
+    tree.width = (bricksX + SPARSE_NODE_MASK) >> SPARSE_NODE_BITS;
+    tree.height = (bricksY + SPARSE_NODE_MASK) >> SPARSE_NODE_BITS;
+    tree.depth = (bricksZ + SPARSE_NODE_MASK) >> SPARSE_NODE_BITS;
+    tree.root.resize((size_t)tree.width * tree.height * tree.depth);
+
+    // Samples inside a brick only read its voxels, apron included, so the range of its stored voxels is exact
+    size_t stored = (voxelBytes - VOXEL_PADDING) / (BRICK_VOXELS * getVoxelSize(format));
+    std::vector<Macrocell> storedRanges(stored);
+
+    #pragma omp parallel for schedule(static)
+    for (int brick = 0; brick < (int)stored; ++brick)
+    {
+        Macrocell range{INF, -INF};
+        for (size_t i = (size_t)brick * BRICK_VOXELS; i < (size_t)(brick + 1) * BRICK_VOXELS; ++i)
+        {
+            float value = decode(i);
+            range.min = std::min(range.min, value);
+            range.max = std::max(range.max, value);
+        }
+        storedRanges[brick] = range;
+    }
+
+    // Tile nodes, by the offset of the constant brick they repeat
+    std::map<uint32_t, uint32_t> tiles;
+
+    for (int nx = 0; nx < tree.width; ++nx)
+    {
+        for (int ny = 0; ny < tree.height; ++ny)
+        {
+            for (int nz = 0; nz < tree.depth; ++nz)
+            {
+                // Calls f(local, brick) for every brick of the node inside the volume
+                auto forEachBrick = [&](auto &&f)
+                {
+                    for (int x = 0; x < SPARSE_NODE_SIZE && (nx << SPARSE_NODE_BITS) + x < bricksX; ++x)
+                    {
+                        for (int y = 0; y < SPARSE_NODE_SIZE && (ny << SPARSE_NODE_BITS) + y < bricksY; ++y)
+                        {
+                            for (int z = 0; z < SPARSE_NODE_SIZE && (nz << SPARSE_NODE_BITS) + z < bricksZ; ++z)
+                            {
+                                size_t brick = ((size_t)((nx << SPARSE_NODE_BITS) + x) * bricksY + (ny << SPARSE_NODE_BITS) + y) *
+                                               bricksZ + (nz << SPARSE_NODE_BITS) + z;
+                                f((x << SPARSE_NODE_BITS | y) << SPARSE_NODE_BITS | z, brick);
+                            }
+                        }
+                    }
+                };
+
+                size_t first = ((size_t)(nx << SPARSE_NODE_BITS) * bricksY + (ny << SPARSE_NODE_BITS)) * bricksZ + (nz << SPARSE_NODE_BITS);
+                bool isTile = true;
+                forEachBrick([&](int, size_t brick)
+                {
+                    isTile = isTile && isConstant[brick] && bricks[brick] == bricks[first];
+                });
+
+                uint32_t &node = tree.root[((size_t)nx * tree.height + ny) * tree.depth + nz];
+
+                if (isTile && tiles.count(bricks[first]))
+                {
+                    node = tiles[bricks[first]];
+                    continue;
+                }
+
+                // Bricks outside the volume are never sampled, they repeat the first one
+                node = (uint32_t)tree.nodes.size();
+                tree.nodes.push_back(SparseNode{{}, INF, -INF});
+                tree.bricks.resize(tree.bricks.size() + SPARSE_NODE_BRICKS, bricks[first]);
+                tree.ranges.resize(tree.ranges.size() + SPARSE_NODE_BRICKS, storedRanges[bricks[first] / BRICK_VOXELS]);
+
+                SparseNode &sparseNode = tree.nodes.back();
+                forEachBrick([&](int local, size_t brick)
+                {
+                    Macrocell const& range = storedRanges[bricks[brick] / BRICK_VOXELS];
+
+                    tree.bricks[(size_t)node * SPARSE_NODE_BRICKS + local] = bricks[brick];
+                    tree.ranges[(size_t)node * SPARSE_NODE_BRICKS + local] = range;
+                    sparseNode.min = std::min(sparseNode.min, range.min);
+                    sparseNode.max = std::max(sparseNode.max, range.max);
+
+                    if (!isConstant[brick])
+                    {
+                        sparseNode.mask[local >> 6] |= 1ull << (local & 63);
+                    }
+                });
+
+                if (isTile)
+                {
+                    tiles.emplace(bricks[first], node);
+                }
+            }
+        }
+    }
+}
+
+// Layout of a volume file: header, one LevelHeader per level, then for every level its brick table, its
+// octree nodes, its macrocells, its sparse tree (root, nodes, bricks and ranges) and its voxels, starting at a
+// multiple of VOLUME_FILE_ALIGNMENT
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t levels;
+    uint64_t key;
+};
+
+struct LevelHeader
+{
+    int32_t width;
+    int32_t height;
+    int32_t depth;
+    int32_t layout;
+    int32_t format;
+    float scale;
+    float offset;
+    float spacing[3];
+    float origin[3];
+    int32_t bricksX;
+    int32_t bricksY;
+    int32_t bricksZ;
+    float octreeMin[3];
+    float octreeMax[3];
+    uint64_t tableOffset;
+    uint64_t nodeOffset;
+    uint64_t nodeCount;
+    int32_t cellsX;
+    int32_t cellsY;
+    int32_t cellsZ;
+    uint64_t cellOffset;
+    int32_t treeX;
+    int32_t treeY;
+    int32_t treeZ;
+    uint64_t treeNodeCount;
+    uint64_t treeOffset;
+    uint64_t voxelOffset;
+    uint64_t voxelBytes;
+};
+
+static char const volumeFileMagic[8] = {'S', 'C', 'G', 'V', 'O', 'L', 'U', 'M'};
+
+inline size_t align(size_t offset)
+{
+    return (offset + VOLUME_FILE_ALIGNMENT - 1) & ~(size_t)(VOLUME_FILE_ALIGNMENT - 1);
+}
+
+bool Volume::save(std::string const& path, uint64_t key) const
+{
+    std::vector<Volume const*> levels{this};
+    for (auto const& mip : mips)
+    {
+        levels.push_back(mip.get());
+    }
+
+    std::vector<LevelHeader> headers(levels.size());
+
+    size_t offset = sizeof(FileHeader) + levels.size() * sizeof(LevelHeader);
+
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        Volume const& level = *levels[i];
+        LevelHeader &header = headers[i];
+
+        header.width = level.width;
+        header.height = level.height;
+        header.depth = level.depth;
+        header.layout = level.layout;
+        header.format = level.format;
+        header.scale = level.scale;
+        header.offset = level.offset;
+        header.spacing[0] = level.spacing.x;
+        header.spacing[1] = level.spacing.y;
+        header.spacing[2] = level.spacing.z;
+        header.origin[0] = level.origin.x;
+        header.origin[1] = level.origin.y;
+        header.origin[2] = level.origin.z;
+        header.bricksX = level.bricksX;
+        header.bricksY = level.bricksY;
+        header.bricksZ = level.bricksZ;
+        header.octreeMin[0] = level.octree.bb.min.x;
+        header.octreeMin[1] = level.octree.bb.min.y;
+        header.octreeMin[2] = level.octree.bb.min.z;
+        header.octreeMax[0] = level.octree.bb.max.x;
+        header.octreeMax[1] = level.octree.bb.max.y;
+        header.octreeMax[2] = level.octree.bb.max.z;
+
+        header.tableOffset = offset;
+        offset += level.bricks.size() * sizeof(uint32_t);
+        header.nodeOffset = offset;
+        header.nodeCount = level.octree.nodes.size();
+        offset += level.octree.nodes.size() * sizeof(OctreeNode);
+        header.cellsX = level.macrocells.width;
+        header.cellsY = level.macrocells.height;
+        header.cellsZ = level.macrocells.depth;
+        header.cellOffset = offset;
+        offset += level.macrocells.cells.size() * sizeof(Macrocell);
+        header.treeX = level.tree.width;
+        header.treeY = level.tree.height;
+        header.treeZ = level.tree.depth;
+        header.treeNodeCount = level.tree.nodes.size();
+        header.treeOffset = offset;
+        offset += level.tree.root.size() * sizeof(uint32_t) + level.tree.nodes.size() * sizeof(SparseNode) +
+                  level.tree.bricks.size() * sizeof(uint32_t) + level.tree.ranges.size() * sizeof(Macrocell);
+        header.voxelOffset = offset = align(offset);
+        header.voxelBytes = level.voxelBytes;
+        offset += level.voxelBytes;
+    }
+
+    FileHeader header{};
+    std::memcpy(header.magic, volumeFileMagic, sizeof(header.magic));
+    header.version = VOLUME_FILE_VERSION;
+    header.levels = (uint32_t)levels.size();
+    header.key = key;
+
+    // Other processes may have the cache mapped, it is written aside and renamed over so they keep the old file
+    std::string tempPath = path + "." + std::to_string(getpid()) + ".tmp";
+
+    std::ofstream fout(tempPath, std::ios::binary | std::ios::trunc);
+
+    fout.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    fout.write(reinterpret_cast<char const*>(headers.data()), (std::streamsize)(headers.size() * sizeof(LevelHeader)));
+
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        Volume const& level = *levels[i];
+
+        fout.write(reinterpret_cast<char const*>(level.bricks.data()), (std::streamsize)(level.bricks.size() * sizeof(uint32_t)));
+        fout.write(reinterpret_cast<char const*>(level.octree.nodes.data()), (std::streamsize)(level.octree.nodes.size() * sizeof(OctreeNode)));
+        fout.write(reinterpret_cast<char const*>(level.macrocells.cells.data()), (std::streamsize)(level.macrocells.cells.size() * sizeof(Macrocell)));
+        fout.write(reinterpret_cast<char const*>(level.tree.root.data()), (std::streamsize)(level.tree.root.size() * sizeof(uint32_t)));
+        fout.write(reinterpret_cast<char const*>(level.tree.nodes.data()), (std::streamsize)(level.tree.nodes.size() * sizeof(SparseNode)));
+        fout.write(reinterpret_cast<char const*>(level.tree.bricks.data()), (std::streamsize)(level.tree.bricks.size() * sizeof(uint32_t)));
+        fout.write(reinterpret_cast<char const*>(level.tree.ranges.data()), (std::streamsize)(level.tree.ranges.size() * sizeof(Macrocell)));
+
+        std::vector<char> padding(headers[i].voxelOffset - (size_t)fout.tellp(), 0);
+        fout.write(padding.data(), (std::streamsize)padding.size());
+        fout.write(reinterpret_cast<char const*>(level.voxelData), (std::streamsize)level.voxelBytes);
+    }
+
+    fout.flush();
+    bool written = (bool)fout;
+    fout.close();
+
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows
+    if (written)
+    {
+        std::remove(path.c_str());
+    }
+#endif
+
+    if (!written || fout.fail() || std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+std::shared_ptr<Volume> Volume::map(std::string const& path, uint64_t key, size_t cacheSize)
+{
+    auto file = std::make_unique<MappedFile>(path);
+
+    if (!file->isOpen() || file->size < sizeof(FileHeader))
+    {
+        return nullptr;
+    }
+
+    FileHeader header;
+    std::memcpy(&header, file->data, sizeof(header));
+
+    if (std::memcmp(header.magic, volumeFileMagic, sizeof(header.magic)) != 0 ||
+        header.version != VOLUME_FILE_VERSION || header.key != key || header.levels == 0 ||
+        sizeof(FileHeader) + header.levels * sizeof(LevelHeader) > file->size)
+    {
+        return nullptr;
+    }
+
+    std::vector<LevelHeader> headers(header.levels);
+    std::memcpy(headers.data(), file->data + sizeof(FileHeader), header.levels * sizeof(LevelHeader));
+
+    std::shared_ptr<Volume> volume(new Volume());
+
+    for (size_t i = 0; i < headers.size(); ++i)
+    {
+        LevelHeader const& level = headers[i];
+
+        size_t brickCount = level.layout == VolumeLayout::Bricked ? (size_t)level.bricksX * level.bricksY * level.bricksZ : 0;
+        size_t cellCount = (size_t)level.cellsX * level.cellsY * level.cellsZ;
+        size_t rootCount = (size_t)level.treeX * level.treeY * level.treeZ;
+        size_t treeBytes = rootCount * sizeof(uint32_t) + level.treeNodeCount * sizeof(SparseNode) +
+                           level.treeNodeCount * SPARSE_NODE_BRICKS * (sizeof(uint32_t) + sizeof(Macrocell));
+
+        if (level.tableOffset + brickCount * sizeof(uint32_t) > level.nodeOffset ||
+            level.nodeOffset + level.nodeCount * sizeof(OctreeNode) > level.cellOffset || level.nodeCount == 0 ||
+            level.cellOffset + cellCount * sizeof(Macrocell) > level.treeOffset ||
+            level.treeOffset + treeBytes > level.voxelOffset ||
+            (level.layout == VolumeLayout::Sparse && level.treeNodeCount == 0) ||
+            level.voxelOffset + level.voxelBytes > file->size)
+        {
+            return nullptr;
+        }
+
+        Volume* target = volume.get();
+        if (i > 0)
+        {
+            volume->mips.emplace_back(new Volume());
+            target = volume->mips.back().get();
+        }
+
+        target->width = level.width;
+        target->height = level.height;
+        target->depth = level.depth;
+        target->layout = (VolumeLayout)level.layout;
+        target->format = (VoxelFormat)level.format;
+        target->scale = level.scale;
+        target->offset = level.offset;
+        target->spacing = Vec3f(level.spacing[0], level.spacing[1], level.spacing[2]);
+        target->origin = Vec3f(level.origin[0], level.origin[1], level.origin[2]);
+        target->bricksX = level.bricksX;
+        target->bricksY = level.bricksY;
+        target->bricksZ = level.bricksZ;
+
+        if (target->layout == VolumeLayout::Linear)
+        {
+            target->strideX = (size_t)target->height * target->depth;
+            target->strideY = (size_t)target->depth;
+        }
+        else
+        {
+            target->strideX = BRICK_SIDE * BRICK_SIDE;
+            target->strideY = BRICK_SIDE;
+        }
+
+        // The brick table, the octree, the macrocells and the sparse tree are small, keep them in memory
+        target->bricks.resize(brickCount);
+        std::memcpy(target->bricks.data(), file->data + level.tableOffset, brickCount * sizeof(uint32_t));
+
+        target->octree = Octree(BoundingBox(
+            Vec3f(level.octreeMin[0], level.octreeMin[1], level.octreeMin[2]),
+            Vec3f(level.octreeMax[0], level.octreeMax[1], level.octreeMax[2])));
+        target->octree.nodes.resize(level.nodeCount);
+        std::memcpy(target->octree.nodes.data(), file->data + level.nodeOffset, level.nodeCount * sizeof(OctreeNode));
+
+        target->macrocells.width = level.cellsX;
+        target->macrocells.height = level.cellsY;
+        target->macrocells.depth = level.cellsZ;
+        target->macrocells.cells.resize(cellCount);
+        std::memcpy(target->macrocells.cells.data(), file->data + level.cellOffset, cellCount * sizeof(Macrocell));
+
+        SparseTree &tree = target->tree;
+        uint8_t const* treeData = file->data + level.treeOffset;
+        tree.width = level.treeX;
+        tree.height = level.treeY;
+        tree.depth = level.treeZ;
+        tree.root.resize(rootCount);
+        tree.nodes.resize(level.treeNodeCount);
+        tree.bricks.resize(level.treeNodeCount * SPARSE_NODE_BRICKS);
+        tree.ranges.resize(level.treeNodeCount * SPARSE_NODE_BRICKS);
+        std::memcpy(tree.root.data(), treeData, rootCount * sizeof(uint32_t));
+        treeData += rootCount * sizeof(uint32_t);
+        std::memcpy(tree.nodes.data(), treeData, tree.nodes.size() * sizeof(SparseNode));
+        treeData += tree.nodes.size() * sizeof(SparseNode);
+        std::memcpy(tree.bricks.data(), treeData, tree.bricks.size() * sizeof(uint32_t));
+        treeData += tree.bricks.size() * sizeof(uint32_t);
+        std::memcpy(tree.ranges.data(), treeData, tree.ranges.size() * sizeof(Macrocell));
+
+        for (uint32_t node : tree.root)
+        {
+            if (node >= level.treeNodeCount)
+            {
+                return nullptr;
+            }
+        }
+
+        // Drop a corrupted tree rather than follow children out of the array
+        for (auto const& node : target->octree.nodes)
+        {
+            if (node.children != 0 && (size_t)node.children + 8 > level.nodeCount)
+            {
+                return nullptr;
+            }
+        }
+
+        target->voxelData = file->data + level.voxelOffset;
+        target->voxelBytes = level.voxelBytes;
+
+        // Only bricks can be evicted, linear levels are left to the OS
+        if (target->layout != VolumeLayout::Linear)
+        {
+            size_t brickSize = BRICK_VOXELS * getVoxelSize(target->format);
+            size_t storedCount = level.voxelBytes / brickSize;
+
+            // Constant bricks of a sparse volume are stored once for every brick with their value
+            std::vector<bool> shared(storedCount, false);
+            if (target->layout == VolumeLayout::Sparse)
+            {
+                std::vector<bool> referenced(storedCount, false);
+                for (uint32_t brick : target->tree.bricks)
+                {
+                    size_t stored = brick / BRICK_VOXELS;
+                    if (stored >= storedCount)
+                    {
+                        return nullptr;
+                    }
+
+                    shared[stored] = referenced[stored];
+                    referenced[stored] = true;
+                }
+            }
+
+            target->cache = std::make_unique<BrickCache>(
+                *file, target->voxelData, brickSize, storedCount,
+                std::max<size_t>(cacheSize / brickSize, 1), std::move(shared));
+        }
+    }
+
+    volume->file = std::move(file);
+
+    return volume;
+}
+
+void Volume::touchBricks(BoundingBox const& bb) const
+{
+    // Samples read one voxel past the box on each side
+    int minX = std::max((int)bb.min.x - 1, 0) >> BRICK_BITS;
+    int minY = std::max((int)bb.min.y - 1, 0) >> BRICK_BITS;
+    int minZ = std::max((int)bb.min.z - 1, 0) >> BRICK_BITS;
+    int maxX = std::min((int)bb.max.x + 1, width - 1) >> BRICK_BITS;
+    int maxY = std::min((int)bb.max.y + 1, height - 1) >> BRICK_BITS;
+    int maxZ = std::min((int)bb.max.z + 1, depth - 1) >> BRICK_BITS;
+
+    for (int bx = minX; bx <= maxX; ++bx)
+    {
+        for (int by = minY; by <= maxY; ++by)
+        {
+            for (int bz = minZ; bz <= maxZ; ++bz)
+            {
+                uint32_t brick = layout == VolumeLayout::Sparse ?
+                    tree.bricks[tree.getBrick(bx, by, bz)] :
+                    bricks[((size_t)bx * bricksY + by) * bricksZ + bz];
+                cache->touch(brick / BRICK_VOXELS);
+            }
+        }
+    }
+}
+
+void Volume::trimCache()
+{
+    if (cache)
+    {
+        cache->trim();
+    }
+
+    for (auto& mip : mips)
+    {
+        mip->trimCache();
+    }
+}
+
+BoundingBox Volume::getBounds() const
+{
+    return BoundingBox(
+        Vec3f(0 + V_EPS, 0 + V_EPS, 0 + V_EPS),
+        Vec3f(width - V_EPS, height - V_EPS, depth - V_EPS));
+}
+
+void Volume::buildMips(int levels)
+{
+    mips.clear();
+
+    // Integer mips keep the quantisation of the volume
+    float maxValue = offset + scale * (format == VoxelFormat::UInt8 ? 255.0f : 65535.0f);
+
+    Volume const* previous = this;
+
+    for (int level = 1; level <= levels; ++level)
+    {
+        int mipWidth = (previous->width + 1) / 2;
+        int mipHeight = (previous->height + 1) / 2;
+        int mipDepth = (previous->depth + 1) / 2;
+
+        // Too small to be sampled
+        if (std::min(std::min(mipWidth, mipHeight), mipDepth) <= 2 * V_EPS)
+        {
+            break;
+        }
+
+        auto mip = std::make_unique<Volume>(mipWidth, mipHeight, mipDepth, format, offset, maxValue);
+        mip->spacing = previous->spacing * 2.0f;
+        mip->origin = previous->origin;
+
+        // Clamp odd sizes to the last voxel
+        #pragma omp parallel for schedule(static)
+        for (int x = 0; x < mipWidth; ++x)
+        {
+            int x0 = 2 * x;
+            int x1 = std::min(x0 + 1, previous->width - 1);
+
+            for (int y = 0; y < mipHeight; ++y)
+            {
+                int y0 = 2 * y;
+                int y1 = std::min(y0 + 1, previous->height - 1);
+
+                for (int z = 0; z < mipDepth; ++z)
+                {
+                    int z0 = 2 * z;
+                    int z1 = std::min(z0 + 1, previous->depth - 1);
+
+                    float sum =
+                        previous->getVoxel(x0, y0, z0) + previous->getVoxel(x0, y0, z1) +
+                        previous->getVoxel(x0, y1, z0) + previous->getVoxel(x0, y1, z1) +
+                        previous->getVoxel(x1, y0, z0) + previous->getVoxel(x1, y0, z1) +
+                        previous->getVoxel(x1, y1, z0) + previous->getVoxel(x1, y1, z1);
+
+                    mip->setVoxel(x, y, z, sum * 0.125f);
+                }
+            }
+        }
+
+        // Voxel centres of the finer level sit at twice the coordinates
+        BoundingBox const& bb = previous->octree.bb;
+        mip->octree.bb = intersect(BoundingBox(bb.min * 0.5f, bb.max * 0.5f), mip->getBounds());
+
+        mips.push_back(std::move(mip));
+        previous = mips.back().get();
+    }
+}
+
+std::shared_ptr<Volume> convertVolume(std::shared_ptr<Volume> const& volume, VoxelFormat format)
+{
+    if (volume->format == format)
+    {
+        return volume;
+    }
+
+    Vec2f range = volume->getRange();
+    auto converted = std::make_shared<Volume>(volume->width, volume->height, volume->depth, format, range.x, range.y);
+    converted->spacing = volume->spacing;
+    converted->origin = volume->origin;
+    converted->octree.bb = volume->octree.bb;
+
+    #pragma omp parallel for schedule(static)
+    for (int x = 0; x < volume->width; ++x)
+    {
+        for (int y = 0; y < volume->height; ++y)
+        {
+            for (int z = 0; z < volume->depth; ++z)
+            {
+                converted->setVoxel(x, y, z, volume->getVoxel(x, y, z));
+            }
+        }
+    }
+
+    return converted;
+}
+
+void buildOctrees(Volume &volume, int levels)
+{
+    buildOctree(volume, volume.octree, levels);
+
+    for (auto& mip : volume.mips)
+    {
+        levels = std::max(levels - 1, 0);
+        buildOctree(*mip, mip->octree, levels);
+    }
+}
+
+void buildMacrocells(Volume &volume)
+{
+    MacrocellGrid &grid = volume.macrocells;
+    grid.width = (volume.width + MACROCELL_SIZE - 1) / MACROCELL_SIZE;
+    grid.height = (volume.height + MACROCELL_SIZE - 1) / MACROCELL_SIZE;
+    grid.depth = (volume.depth + MACROCELL_SIZE - 1) / MACROCELL_SIZE;
+    grid.cells.resize((size_t)grid.width * grid.height * grid.depth);
+    grid.majorants.clear();
+
+    // As octree leaves, a cell covers the voxels interpolated by any sample inside it
+    #pragma omp parallel for schedule(dynamic)
+    for (int x = 0; x < grid.width; ++x)
+    {
+        for (int y = 0; y < grid.height; ++y)
+        {
+            for (int z = 0; z < grid.depth; ++z)
+            {
+                Vec2f range = volume.getRange(
+                    x * MACROCELL_SIZE - 1, y * MACROCELL_SIZE - 1, z * MACROCELL_SIZE - 1,
+                    (x + 1) * MACROCELL_SIZE, (y + 1) * MACROCELL_SIZE, (z + 1) * MACROCELL_SIZE);
+
+                grid.cells[grid.getIndex(x, y, z)] = Macrocell{range.x, range.y};
+            }
+        }
+    }
+
+    for (auto& mip : volume.mips)
+    {
+        buildMacrocells(*mip);
+    }
+}
+
+inline void updateLevelMajorants(Volume &volume, TransferFunction const& transferFunction)
+{
+    volume.octree.updateMajorants(transferFunction);
+    volume.macrocells.updateMajorants(transferFunction);
+    volume.tree.updateMajorants(transferFunction);
+
+    for (auto& mip : volume.mips)
+    {
+        updateLevelMajorants(*mip, transferFunction);
+    }
+}
+
+void updateMajorants(Volume &volume, TransferFunction &transferFunction)
+{
+    // The root of the octree bounds every value that can be sampled, mips average the values and stay within them
+    if (!volume.octree.nodes.empty())
+    {
+        transferFunction.setRange(volume.octree.nodes[0].min, volume.octree.nodes[0].max);
+    }
+
+    updateLevelMajorants(volume, transferFunction);
+}
+
+void buildOctree(Volume const& volume, Octree &octree, int levels)
+{
+    // Traversals keep one frame per level on the stack
+    levels = std::min(levels, OCTREE_MAX_LEVELS);
+
+    // Value range of every cell of every level, cells indexed with z varying fastest
+    std::vector<std::vector<Vec2f>> ranges(levels + 1);
+    // Cells whose children are all leaves with the same range, these become leaves
+    std::vector<std::vector<bool>> uniform(levels + 1);
+
+    int cells = 1 << levels;
+    ranges[levels].resize((size_t)cells * cells * cells);
+
+    // Leaves are independent, each reads the voxels that any sample within one voxel of it interpolates
+    // Interpolated values never leave the range of these voxels
+    #pragma omp parallel for schedule(dynamic)
+    for (int cell = 0; cell < cells * cells * cells; ++cell)
+    {
+        int x = cell / (cells * cells);
+        int y = (cell / cells) % cells;
+        int z = cell % cells;
+
+        BoundingBox bb = octree.getBounds(levels, x, y, z);
+        ranges[levels][cell] = volume.getRange(
+            (int)std::round(bb.min.x - 1) - 1, (int)std::round(bb.min.y - 1) - 1, (int)std::round(bb.min.z - 1) - 1,
+            (int)std::round(bb.max.x + 1), (int)std::round(bb.max.y + 1), (int)std::round(bb.max.z + 1));
+    }
+
+    uniform[levels].assign(ranges[levels].size(), true);
+
+    // Merge the children of every cell, level by level
+    for (int level = levels - 1; level >= 0; --level)
+    {
+        int size = 1 << level;
+        ranges[level].resize((size_t)size * size * size);
+        uniform[level].resize(ranges[level].size());
+
+        for (int x = 0; x < size; ++x)
+        {
+            for (int y = 0; y < size; ++y)
+            {
+                for (int z = 0; z < size; ++z)
+                {
+                    Vec2f range(INF, -INF);
+                    bool same = true;
+
+                    for (int child = 0; child < 8; ++child)
+                    {
+                        int cx = 2 * x + ((child >> 2) & 1);
+                        int cy = 2 * y + ((child >> 1) & 1);
+                        int cz = 2 * z + (child & 1);
+                        size_t childIndex = ((size_t)cx * 2 * size + cy) * 2 * size + cz;
+                        Vec2f childRange = ranges[level + 1][childIndex];
+
+                        same = same && uniform[level + 1][childIndex] && (child == 0 || (childRange.x == range.x && childRange.y == range.y));
+                        range.x = std::min(range.x, childRange.x);
+                        range.y = std::max(range.y, childRange.y);
+                    }
+
+                    size_t index = ((size_t)x * size + y) * size + z;
+                    ranges[level][index] = range;
+                    uniform[level][index] = same;
+                }
+            }
+        }
+    }
+
+    // Emit the nodes breadth first, children of a node are consecutive
+    struct Cell
+    {
+        int level;
+        int x;
+        int y;
+        int z;
+    };
+
+    std::vector<Cell> cellOf{{0, 0, 0, 0}};
+    octree.nodes.assign(1, OctreeNode{});
+
+    for (size_t node = 0; node < octree.nodes.size(); ++node)
+    {
+        Cell cell = cellOf[node];
+        int size = 1 << cell.level;
+        size_t index = ((size_t)cell.x * size + cell.y) * size + cell.z;
+
+        octree.nodes[node].min = ranges[cell.level][index].x;
+        octree.nodes[node].max = ranges[cell.level][index].y;
+
+        if (uniform[cell.level][index])
+        {
+            continue;
+        }
+
+        octree.nodes[node].children = (uint32_t)octree.nodes.size();
+
+        for (int child = 0; child < 8; ++child)
+        {
+            cellOf.push_back(Cell{
+                cell.level + 1,
+                2 * cell.x + ((child >> 2) & 1),
+                2 * cell.y + ((child >> 1) & 1),
+                2 * cell.z + (child & 1)});
+            octree.nodes.emplace_back();
+        }
+    }
+
+    octree.nodes.shrink_to_fit();
+}
+
+}
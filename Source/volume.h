@@ -1,27 +1,205 @@
 #ifndef RAYTRACER_VOLUME_H
 #define RAYTRACER_VOLUME_H
 
+#include "boundingbox.h"
+#include "brickcache.h"
+#include "macrocellgrid.h"
+#include "mappedfile.h"
 #include "octree.h"
+#include "enums.h"
+#include "half.h"
 #include "settings.h"
+#include "sparsetree.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
-#define VOLUME_SIZE 512
 #define V_EPS 2
 
+// Bricked layout: cubes of BRICK_SIZE voxels plus a one voxel apron copied from the next brick,
+// so the 8 corners of a trilinear sample always come from the same brick
+#define BRICK_BITS 3
+#define BRICK_SIZE (1 << BRICK_BITS)
+#define BRICK_MASK (BRICK_SIZE - 1)
+#define BRICK_SIDE (BRICK_SIZE + 1)
+#define BRICK_VOXELS (BRICK_SIDE * BRICK_SIDE * BRICK_SIDE)
+
+// Bytes allocated after the voxels, so narrow formats can be gathered as 32 bit words
+#define VOXEL_PADDING 4
+
+// Files written by an older version are ignored
+#define VOLUME_FILE_VERSION 6
+
+// Alignment of the voxels inside a volume file, in bytes
+#define VOLUME_FILE_ALIGNMENT 4096
+
+// Positions sampled together by sampleVolumeN
+#if defined(__AVX2__)
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__)
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
 namespace scg
 {
 
 class Volume
 {
 public:
-    int height = VOLUME_SIZE;
-    int width = VOLUME_SIZE;
-    int depth = VOLUME_SIZE;
+    int width;  // Size along x
+    int height; // Size along y
+    int depth;  // Size along z
+
+    VolumeLayout layout = VolumeLayout::Linear;
+
+    // Integer formats store (value - offset) / scale
+    VoxelFormat format;
+    float scale = 1.0f;
+    float offset = 0.0f;
+
+    // Linear: voxels stored with z varying fastest, allocated once when the volume is created
+    // Bricked: bricks of BRICK_SIDE^3 voxels, each with z varying fastest, bricks stored in Z-order
+    // Sparse: as bricked, but all constant bricks with the same value are stored once, found through tree
+    std::vector<uint8_t> data;
+
+    // Volumes mapped from a file read their voxels from it instead of data, mips share the file of the volume
+    std::unique_ptr<MappedFile> file;
+    std::unique_ptr<BrickCache> cache;
+
+    // Bricked: offset into data (in voxels) of every brick, indexed with z varying fastest
+    std::vector<uint32_t> bricks;
+    int bricksX = 0;
+    int bricksY = 0;
+    int bricksZ = 0;
+
+    // Distance in data between neighbouring voxels inside the same brick (or the whole volume)
+    size_t strideX;
+    size_t strideY;
 
-    float data[VOLUME_SIZE][VOLUME_SIZE][VOLUME_SIZE];
+    // Sparse: offsets of the bricks and their value ranges
+    SparseTree tree;
 
     Octree octree;
+    MacrocellGrid macrocells;
+
+    // Coarser levels of detail, each averaging 2^3 voxels of the previous level
+    std::vector<std::unique_ptr<Volume>> mips;
+
+    // Size of a voxel along each axis and position of the corner of voxel 0, in scene units
+    // The octree and the samplers work in voxel coordinates, voxel i has its centre at i + 0.5
+    Vec3f spacing = Vec3f(1.0f, 1.0f, 1.0f);
+    Vec3f origin = Vec3f(0.0f, 0.0f, 0.0f);
+
+    // Integer formats quantise the range [minValue, maxValue]
+    Volume(int width, int height, int depth,
+           VoxelFormat format = VoxelFormat::Float32, float minValue = 0.0f, float maxValue = 0.0f);
+
+    // Volumes are large, share them instead of copying
+    Volume(Volume const&) = delete;
+    Volume& operator =(Volume const&) = delete;
+
+    // Maps a file written by save with the same key, keeping at most cacheSize bytes of bricks resident per level
+    // Returns nullptr if the file cannot be read or is out of date
+    static std::shared_ptr<Volume> map(std::string const& path, uint64_t key, size_t cacheSize);
+
+    // Writes the volume, its mips and their octrees, tagged with a key describing how they were built
+    bool save(std::string const& path, uint64_t key) const;
+
+    // Pages in the bricks overlapping bb ahead of sampling them, only mapped volumes are cached
+    inline void prefetch(BoundingBox const& bb) const
+    {
+        if (cache)
+        {
+            touchBricks(bb);
+        }
+    }
+
+    // Evicts the least recently used bricks of a mapped volume, called between frames
+    void trimCache();
+
+    inline size_t getIndex(int x, int y, int z) const
+    {
+        if (layout == VolumeLayout::Linear)
+        {
+            return x * strideX + y * strideY + z;
+        }
+
+        uint32_t brick = layout == VolumeLayout::Sparse ?
+            tree.bricks[tree.getBrick(x >> BRICK_BITS, y >> BRICK_BITS, z >> BRICK_BITS)] :
+            bricks[((x >> BRICK_BITS) * bricksY + (y >> BRICK_BITS)) * bricksZ + (z >> BRICK_BITS)];
+        return brick + (x & BRICK_MASK) * strideX + (y & BRICK_MASK) * strideY + (z & BRICK_MASK);
+    }
+
+    inline float getVoxel(int x, int y, int z) const
+    {
+        return decode(getIndex(x, y, z));
+    }
+
+    // Value of the voxel at index in the storage
+    inline float decode(size_t index) const
+    {
+        switch (format)
+        {
+            case VoxelFormat::Float32:
+                return voxels<float>()[index];
+            case VoxelFormat::UInt16:
+                return voxels<uint16_t>()[index] * scale + offset;
+            case VoxelFormat::UInt8:
+                return voxels<uint8_t>()[index] * scale + offset;
+            case VoxelFormat::Float16:
+                return voxels<Half>()[index];
+        }
+
+        return 0.0f;
+    }
+
+    // Only valid while the layout is linear
+    void setVoxel(int x, int y, int z, float value);
+
+    // Reorganises the voxels of a linear volume and its mips, releasing the previous storage
+    // Sparse volumes treat bricks with all values at or below the threshold as empty, replacing their voxels
+    // with the average of all empty voxels. Bricks left uniform share their storage
+    void setLayout(VolumeLayout layout, float threshold = 0.0f);
+
+    // Builds the given number of coarser levels in memory, with a linear layout until setLayout
+    void buildMips(int levels);
+
+    // Level 0 is the volume itself, levels past the coarsest mip return the coarsest mip
+    inline Volume const& getLevel(int level) const
+    {
+        if (level <= 0 || mips.empty())
+        {
+            return *this;
+        }
+
+        return *mips[std::min(level, (int)mips.size()) - 1];
+    }
+
+    // Smallest and largest voxel values
+    Vec2f getRange() const;
+
+    // Smallest and largest voxel values inside the given voxels (inclusive), clamped to the volume
+    Vec2f getRange(int minX, int minY, int minZ, int maxX, int maxY, int maxZ) const;
+
+    size_t getMemoryUsage() const;
+
+    // Region that can be sampled (including gradients) without reading outside the data, in voxel coordinates
+    BoundingBox getBounds() const;
+
+    // Scene units relative to the volume position to voxel coordinates, and back
+    inline Vec3f toVoxel(Vec3f const& pos) const
+    {
+        return (pos - origin) / spacing;
+    }
 
-    Volume(int height, int width, int depth);
+    inline Vec3f fromVoxel(Vec3f const& pos) const
+    {
+        return pos * spacing + origin;
+    }
 
     inline float sampleVolume(Vec3f const &pos) const
     {
@@ -29,33 +207,33 @@ public:
         int py = (int)(pos.y - 0.5f);
         int pz = (int)(pos.z - 0.5f);
 
-        //return data[px][py][pz];
-
         float dx = pos.x - px - 0.5f;
         float dy = pos.y - py - 0.5f;
         float dz = pos.z - pz - 0.5f;
 
-        float c000 = data[px][py][pz];
-        float c001 = data[px][py][pz + 1];
-        float c010 = data[px][py + 1][pz];
-        float c011 = data[px][py + 1][pz + 1];
-        float c100 = data[px + 1][py][pz];
-        float c101 = data[px + 1][py][pz + 1];
-        float c110 = data[px + 1][py + 1][pz];
-        float c111 = data[px + 1][py + 1][pz + 1];
+        size_t index = getIndex(px, py, pz);
 
-        float c00 = lerp(c000, c100, dx);
-        float c01 = lerp(c001, c101, dx);
-        float c10 = lerp(c010, c110, dx);
-        float c11 = lerp(c011, c111, dx);
+        // Conversion happens inside the kernel, integer formats are rescaled once after interpolating
+        switch (format)
+        {
+            case VoxelFormat::Float32:
+                return trilinear(voxels<float>() + index, dx, dy, dz);
+            case VoxelFormat::UInt16:
+                return trilinear(voxels<uint16_t>() + index, dx, dy, dz) * scale + offset;
+            case VoxelFormat::UInt8:
+                return trilinear(voxels<uint8_t>() + index, dx, dy, dz) * scale + offset;
+            case VoxelFormat::Float16:
+                return trilinear(voxels<Half>() + index, dx, dy, dz);
+        }
 
-        float c0 = lerp(c00, c10, dy);
-        float c1 = lerp(c01, c11, dy);
+        return 0.0f;
+    }
 
-        float coef =  lerp(c0, c1, dz);
+    // Samples count positions, SIMD_WIDTH at a time
+    void sampleVolumeN(Vec3f const* positions, float* values, int count) const;
 
-        return coef;
-    }
+    // Samples count positions given as separate coordinate arrays, all aligned to 32 bytes
+    void sampleVolumeN(float const* x, float const* y, float const* z, float* values, int count) const;
 
     inline Vec3f getGradient(Vec3f const& pos, float eps) const
     {
@@ -63,19 +241,96 @@ public:
         Vec3f deltaY(0, eps, 0);
         Vec3f deltaZ(0, 0, eps);
 
+        Vec3f positions[6] = {pos - deltaX, pos + deltaX, pos - deltaY, pos + deltaY, pos - deltaZ, pos + deltaZ};
+        float values[6];
+        sampleVolumeN(positions, values, 6);
+
         return Vec3f(
-            sampleVolume(pos - deltaX) - sampleVolume(pos + deltaX),
-            sampleVolume(pos - deltaY) - sampleVolume(pos + deltaY),
-            sampleVolume(pos - deltaZ) - sampleVolume(pos + deltaZ));
+            values[0] - values[1],
+            values[2] - values[3],
+            values[4] - values[5]);
     }
 
+    // Value and gradient at pos from a single read of the surrounding 4^3 voxels, eps must be at most 1
+    float sampleVolumeGradient(Vec3f const& pos, float eps, Vec3f& gradient) const;
+
     inline Vec3f getGradientNormalised(Vec3f const& pos, float eps) const
     {
         return normalise(getGradient(pos, eps));
     }
+
+private:
+    // Start of the voxels, in data or in the mapped file
+    uint8_t const* voxelData = nullptr;
+    size_t voxelBytes = 0;
+
+    Volume() = default;
+
+    void encode(uint8_t* voxel, float value) const;
+
+    void touchBricks(BoundingBox const& bb) const;
+
+    // Builds the tree of a sparse volume from the offset of every brick, constant bricks become inactive
+    void buildTree(std::vector<uint32_t> const& bricks, std::vector<bool> const& isConstant);
+
+    // Samples SIMD_WIDTH positions given as separate, aligned coordinate arrays
+    void sampleBatch(float const* x, float const* y, float const* z, float* values) const;
+
+    // Reads the 4^3 voxels starting at x, y, z
+    template<typename T>
+    void loadNeighbourhood(int x, int y, int z, float neighbourhood[4][4][4]) const;
+
+    template<typename T>
+    inline T const* voxels() const
+    {
+        return reinterpret_cast<T const*>(voxelData);
+    }
+
+    template<typename T>
+    inline float trilinear(T const* corner, float dx, float dy, float dz) const
+    {
+        float c000 = corner[0];
+        float c001 = corner[1];
+        float c010 = corner[strideY];
+        float c011 = corner[strideY + 1];
+        float c100 = corner[strideX];
+        float c101 = corner[strideX + 1];
+        float c110 = corner[strideX + strideY];
+        float c111 = corner[strideX + strideY + 1];
+
+        float c00 = lerp(c000, c100, dx);
+        float c01 = lerp(c001, c101, dx);
+        float c10 = lerp(c010, c110, dx);
+        float c11 = lerp(c011, c111, dx);
+
+        float c0 = lerp(c00, c10, dy);
+        float c1 = lerp(c01, c11, dy);
+
+        float coef =  lerp(c0, c1, dz);
+
+        return coef;
+    }
 };
 
-void buildOctree(Volume const& volume, Octree &octree, int levels, Settings const& settings);
+// Bytes used by a single voxel
+size_t getVoxelSize(VoxelFormat format);
+
+// Octree of the value ranges of the volume, independent of the transfer function
+void buildOctree(Volume const& volume, Octree &octree, int levels);
+
+// Copy of a linear volume (before building its octree) in another format, integer formats quantise its range
+// Returns the volume itself if it already has the format
+std::shared_ptr<Volume> convertVolume(std::shared_ptr<Volume> const& volume, VoxelFormat format);
+
+// Builds the octree of the volume and of every mip, coarser mips use one level less each
+void buildOctrees(Volume &volume, int levels);
+
+// Builds the macrocell grid of the volume and of every mip
+void buildMacrocells(Volume &volume);
+
+// Recomputes the majorants of the volume and of every mip, called whenever the transfer function changes
+// The table of the transfer function is baked over the values of the volume first
+void updateMajorants(Volume &volume, TransferFunction &transferFunction);
 
 }
 
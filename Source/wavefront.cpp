@@ -0,0 +1,247 @@
+#include "wavefront.h"
+
+#include "raytrace.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <omp.h>
+
+namespace scg
+{
+
+void Wavefront::render(Scene const& scene, Camera const& camera, Vec3f const& rotation, Settings const& settings,
+                       Sampler *samplers, Vec3f *image)
+{
+    generate(camera, rotation, samplers);
+
+    for (int bounces = 0; bounces < settings.maxDepth && !queue.empty(); ++bounces)
+    {
+        trackVolume(scene, settings, samplers, bounces);
+        intersectSurfaces(scene);
+        sortQueue(scene);
+        shade(scene, settings, samplers, bounces);
+        traceShadows(scene, settings, samplers);
+        accumulate(image, bounces);
+    }
+}
+
+void Wavefront::generate(Camera const& camera, Vec3f const& rotation, Sampler *samplers)
+{
+    int count = camera.width * camera.height;
+
+    rays.resize(count);
+    throughputs.resize(count);
+    colours.resize(count);
+    iors.resize(count);
+    lobes.resize(count);
+    pixels.resize(count);
+    intersections.resize(count);
+    hits.resize(count);
+    alive.resize(count);
+    shadowRays.resize(count);
+    shadowDistances.resize(count);
+    shadowContributions.resize(count);
+    needsShadowRay.resize(count);
+
+    #pragma omp parallel for schedule(static)
+    for (int path = 0; path < count; ++path)
+    {
+        Ray ray = camera.getRay(path % camera.width, path / camera.width, samplers[omp_get_thread_num()]);
+        ray.minT = RAY_EPS;
+
+        ray.origin = rotate(ray.origin, rotation);
+        ray.direction = rotate(ray.direction, rotation);
+
+        rays[path] = ray;
+        throughputs[path] = Vec3f(1.0f, 1.0f, 1.0f);
+        colours[path] = Vec3f(0.0f, 0.0f, 0.0f);
+        iors[path] = 1.0f; // Air
+        lobes[path] = BSDFLobe::Null;
+        pixels[path] = path;
+    }
+
+    queue.resize(count);
+    std::iota(queue.begin(), queue.end(), 0);
+}
+
+void Wavefront::trackVolume(Scene const& scene, Settings const& settings, Sampler *samplers, int bounces)
+{
+    // Detail is lost deeper into the path, sample a coarser level
+    int level = bounces >= settings.bounceMipDepth ? settings.bounceMipLevel : 0;
+
+    int batches = ((int)queue.size() + TRACK_BATCH - 1) / TRACK_BATCH;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int batch = 0; batch < batches; ++batch)
+    {
+        int first = batch * TRACK_BATCH;
+        int count = std::min(TRACK_BATCH, (int)queue.size() - first);
+
+        castVolumeN(scene, rays.data(), &queue[first], count, intersections.data(), hits.data(), settings,
+                    samplers[omp_get_thread_num()], level);
+    }
+}
+
+void Wavefront::intersectSurfaces(Scene const& scene)
+{
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < (int)queue.size(); ++i)
+    {
+        int path = queue[i];
+
+        // Only objects in front of the volume scattering
+        float maxDistance = hits[path] ? intersections[path].distance : std::numeric_limits<float>::max();
+        if (castObjects(scene, rays[path], intersections[path], maxDistance))
+        {
+            hits[path] = true;
+        }
+    }
+}
+
+void Wavefront::sortQueue(Scene const& scene)
+{
+    // Counting sort on what the paths hit: nothing, then every object, then the volume
+    std::vector<int> offsets(scene.objects.size() + 3, 0);
+
+    auto getKey = [&](int path)
+    {
+        return hits[path] ? intersections[path].objectID + 1 : 0;
+    };
+
+    for (int path : queue)
+    {
+        ++offsets[getKey(path) + 1];
+    }
+
+    for (size_t key = 1; key < offsets.size(); ++key)
+    {
+        offsets[key] += offsets[key - 1];
+    }
+
+    next.resize(queue.size());
+    for (int path : queue)
+    {
+        next[offsets[getKey(path)]++] = path;
+    }
+
+    std::swap(queue, next);
+}
+
+void Wavefront::shade(Scene const& scene, Settings const& settings, Sampler *samplers, int bounces)
+{
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < (int)queue.size(); ++i)
+    {
+        int path = queue[i];
+        Sampler &sampler = samplers[omp_get_thread_num()];
+        Vec3f &throughput = throughputs[path];
+
+        needsShadowRay[path] = false;
+
+        if (!hits[path])
+        {
+            colours[path] += throughput * settings.backgroundLight;
+            alive[path] = false;
+            continue;
+        }
+
+        ScatterEvent interaction;
+        interaction.iorI = iors[path];
+        interaction.sampledLobe = lobes[path];
+
+        Material const* material = getInteraction(scene, rays[path], intersections[path], interaction, throughput, settings, sampler);
+
+        // Add light
+        Light const* hitLight = material->getLight(interaction.uv);
+        if (hitLight != nullptr && (bounces == 0 || interaction.sampledLobe & BSDFLobe::Specular))
+        {
+            colours[path] += throughput * hitLight->getEmittance(interaction);
+        }
+
+        // Direct light, shadow rays are traced by the next stage
+        LightSample sample = SampleLight(interaction, scene, material, hitLight, sampler);
+        sample.contribution = throughput * sample.contribution;
+
+        if (sample.needsShadowRay)
+        {
+            shadowRays[path] = sample.shadowRay;
+            shadowDistances[path] = sample.distance;
+            shadowContributions[path] = sample.contribution;
+            needsShadowRay[path] = true;
+        }
+        else
+        {
+            colours[path] += sample.contribution;
+        }
+
+        alive[path] = bounces < settings.maxDepth - 1 && scatter(material, interaction, rays[path], throughput, bounces, settings, sampler);
+
+        iors[path] = interaction.iorI;
+        lobes[path] = interaction.sampledLobe;
+    }
+}
+
+void Wavefront::traceShadows(Scene const& scene, Settings const& settings, Sampler *samplers)
+{
+    shadowQueue.clear();
+    for (int path : queue)
+    {
+        if (needsShadowRay[path])
+        {
+            shadowQueue.push_back(path);
+        }
+    }
+
+    int batches = ((int)shadowQueue.size() + TRACK_BATCH - 1) / TRACK_BATCH;
+
+    // The intersections of the bounce are no longer needed, the shadow rays reuse them
+    #pragma omp parallel for schedule(dynamic)
+    for (int batch = 0; batch < batches; ++batch)
+    {
+        int first = batch * TRACK_BATCH;
+        int count = std::min(TRACK_BATCH, (int)shadowQueue.size() - first);
+
+        castVolumeN(scene, shadowRays.data(), &shadowQueue[first], count, intersections.data(), hits.data(), settings,
+                    samplers[omp_get_thread_num()], settings.shadowMipLevel);
+
+        for (int i = first; i < first + count; ++i)
+        {
+            int path = shadowQueue[i];
+
+            float maxDistance = hits[path] ? intersections[path].distance : std::numeric_limits<float>::max();
+            if (castObjects(scene, shadowRays[path], intersections[path], maxDistance))
+            {
+                hits[path] = true;
+            }
+
+            // As isOccluded
+            if (!hits[path] || intersections[path].distance + EPS >= shadowDistances[path])
+            {
+                colours[path] += shadowContributions[path];
+            }
+        }
+    }
+}
+
+void Wavefront::accumulate(Vec3f *image, int bounces)
+{
+    next.clear();
+
+    // Finished paths are written out, the others are compacted for the next bounce
+    for (int path : queue)
+    {
+        if (alive[path])
+        {
+            next.push_back(path);
+        }
+        else
+        {
+            image[pixels[path]] += colours[path] / (float)(1 + bounces);
+        }
+    }
+
+    std::swap(queue, next);
+}
+
+}
@@ -0,0 +1,65 @@
+#ifndef RAYTRACER_WAVEFRONT_H
+#define RAYTRACER_WAVEFRONT_H
+
+#include "camera.h"
+#include "enums.h"
+#include "intersection.h"
+#include "pathtrace.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "settings.h"
+#include "vector_type.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace scg
+{
+
+// Streaming alternative to trace, every bounce of all the paths of a frame runs as a sequence of stages
+// Each stage is a flat loop over a queue of paths, whose states are kept as structure of arrays
+// Volume tracking runs batches of paths in lockstep, shading runs over the paths grouped by what they hit
+class Wavefront
+{
+public:
+    // Path states, indexed by path
+    std::vector<Ray> rays;
+    std::vector<Vec3f> throughputs;
+    std::vector<Vec3f> colours;
+    std::vector<float> iors;
+    std::vector<BSDFLobe> lobes;
+    std::vector<int> pixels;
+
+    // Results of the current bounce
+    std::vector<Intersection> intersections;
+    std::vector<uint8_t> hits;
+    std::vector<uint8_t> alive;
+
+    // Next event estimation, the contribution already includes the throughput at the vertex
+    std::vector<Ray> shadowRays;
+    std::vector<float> shadowDistances; // Distance to the light along the shadow ray
+    std::vector<Vec3f> shadowContributions;
+    std::vector<uint8_t> needsShadowRay;
+
+    std::vector<int> queue;       // Paths still traced
+    std::vector<int> next;
+    std::vector<int> shadowQueue; // Paths with a shadow ray to trace
+
+    // Traces one path per pixel of the camera and adds their colours to image, stored row by row
+    // The samplers are indexed by thread
+    void render(Scene const& scene, Camera const& camera, Vec3f const& rotation, Settings const& settings,
+                Sampler *samplers, Vec3f *image);
+
+    void generate(Camera const& camera, Vec3f const& rotation, Sampler *samplers);
+    void trackVolume(Scene const& scene, Settings const& settings, Sampler *samplers, int bounces);
+    void intersectSurfaces(Scene const& scene);
+    void sortQueue(Scene const& scene);
+    void shade(Scene const& scene, Settings const& settings, Sampler *samplers, int bounces);
+    void traceShadows(Scene const& scene, Settings const& settings, Sampler *samplers);
+    void accumulate(Vec3f *image, int bounces);
+};
+
+}
+
+#endif //RAYTRACER_WAVEFRONT_H